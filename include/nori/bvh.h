@@ -42,7 +42,24 @@ NORI_NAMESPACE_BEGIN
  */
 class BVH {
     friend class BVHBuildTask;
+    friend class SBVHBuilder;
+    friend class LBVHBuilder;
 public:
+    /// Available construction algorithms
+    enum EBuilder {
+        /// Top-down binned SAH build using object splits only (default)
+        ESAHBuilder = 0,
+
+        /// SAH build that may also split space, duplicating references
+        ESpatialSplitBuilder,
+
+        /// Linear build from sorted Morton codes
+        ELBVHBuilder,
+
+        /// Linear build with SAH over the top levels
+        EHLBVHBuilder
+    };
+
     /// Create a new and empty BVH
     BVH() { m_shapeOffset.push_back(0u); }
 
@@ -59,9 +76,170 @@ public:
      */
     void addShape(Shape *shape);
 
+    /**
+     * \brief Set the branching factor used for ray traversal
+     *
+     * The SAH builder always produces a binary tree. For a width of 4
+     * or 8, \ref build() additionally collapses it into wide nodes
+     * that store their child bounds in SoA form, so that all children
+     * of a node can be tested against a ray with a single SSE/AVX step.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setWidth(uint32_t width);
+
+    /// Return the branching factor used for ray traversal
+    uint32_t getWidth() const { return m_width; }
+
+    /**
+     * \brief Precompute triangle data in leaf order during \ref build()
+     *
+     * When enabled, one vertex and the two adjacent edges of every mesh
+     * triangle are stored contiguously in BVH leaf order. The leaf loop
+     * then reads them linearly instead of going through the index and
+     * vertex buffers of \ref Mesh, at a cost of 36 bytes per triangle.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setPrecomputeTriangles(bool precompute) { m_precomputeTriangles = precompute; }
+
+    /**
+     * \brief Intersect the triangles of a leaf 4 or 8 at a time
+     *
+     * With a width of 4 or 8, \ref build() stores the triangles of every
+     * leaf in blocks of that many, with the vertex positions in SoA form,
+     * and the leaf loop tests a whole block against the ray with one
+     * SSE/AVX pass. The test is the watertight one by Woop et al.
+     * ("Watertight Ray/Triangle Intersection", JCGT 2013), which cannot
+     * miss on edges shared by neighboring triangles. A width of 1 keeps
+     * the scalar Möller-Trumbore test, which is the default.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setTriangleWidth(uint32_t width);
+
+    /// Return the number of triangles tested at a time
+    uint32_t getTriangleWidth() const { return m_triangleWidth; }
+
+    /**
+     * \brief Set the leaf granularity that the builders optimize for
+     *
+     * The SAH then charges every started group of \c size primitives
+     * in a leaf as one intersection, so that leaves fill the blocks of
+     * the triangle kernel instead of being split further, and the
+     * Morton code builders create leaves with up to <tt>max(2, size)</tt>
+     * primitives. 0 (the default) uses the triangle width.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setLeafSize(uint32_t size) { m_leafSize = size; }
+
+    /// Return the effective leaf granularity
+    uint32_t getLeafSize() const { return m_leafSize != 0 ? m_leafSize : m_triangleWidth; }
+
+    /**
+     * \brief Select the construction algorithm by name
+     *
+     * \c "sah" selects the default binned SAH builder. \c "sbvh" enables
+     * spatial splits: nodes whose children would overlap try to split
+     * space instead, clipping long triangles that straddle the split
+     * plane into two references. This yields tighter nodes for scenes
+     * with long thin triangles (e.g. architecture), at the cost of a
+     * slower, serial build and some duplicated leaf entries.
+     *
+     * \c "lbvh" sorts the primitives along a Morton curve and splits
+     * the sorted list, which is much faster to build than the SAH but
+     * yields a slower tree; \c "hlbvh" additionally builds the top
+     * levels with the SAH. These help startup for very large meshes.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setBuilder(const std::string &name);
+
+    /**
+     * \brief Bound the memory growth of the spatial split builder
+     *
+     * The builder may create at most <tt>budget * primitives</tt>
+     * additional leaf references. Once the budget is used up, only
+     * object splits are considered.
+     */
+    void setSplitBudget(float budget) { m_splitBudget = budget; }
+
+    /**
+     * \brief Cache built hierarchies in the given directory
+     *
+     * \ref build() then hashes the input geometry together with the
+     * build parameters and, if a cache file with a matching key
+     * exists, maps it into memory instead of running the builder.
+     * Otherwise, the freshly built node and index arrays are written
+     * there for the next run. An empty string disables the cache.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setCacheDirectory(const std::string &directory) { m_cacheDirectory = directory; }
+
+    /**
+     * \brief Store the child bounds of wide nodes with reduced precision
+     *
+     * With 8 or 16 bits, the child boxes of every BVH4/BVH8 node are
+     * quantized relative to the parent box, which shrinks the nodes by
+     * 15-45% (depending on width and bits). The full precision nodes
+     * are released afterwards (batched queries then trace their rays
+     * one by one). 0 keeps full precision, which is the default.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setCompression(uint32_t bits);
+
+    /**
+     * \brief Lay out wide nodes in treelets of the given size in bytes
+     *
+     * The collapsed BVH4/BVH8 nodes are normally stored in depth-first
+     * order, so that the siblings of a node and the upper levels of
+     * large trees end up far apart in memory. With a nonzero size, the
+     * nodes are instead grouped into treelets of at most that many
+     * bytes (e.g. 4096 for pages), each holding a connected part of the
+     * tree that is grown by repeatedly adding the child with the
+     * largest surface area, i.e. the one most likely to be visited
+     * next. The child treelets of a treelet follow it in memory.
+     * 0 keeps the depth-first order, which is the default.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setTreeletSize(uint32_t bytes) { m_treeletSize = bytes; }
+
+    /**
+     * \brief Redirect the build messages (\c cout by default)
+     *
+     * Keeps the output of BVHs that are built concurrently apart.
+     */
+    void setLog(std::ostream *log) { m_log = log; }
+
     /// Build the BVH
     void build();
 
+    /**
+     * \brief Update the node bounds after the registered shapes moved
+     *
+     * Recomputes all bounding boxes bottom-up from the current shape
+     * bounds while keeping the tree topology, e.g. after vertex
+     * positions or instance transforms were changed. This is much
+     * cheaper than a rebuild, but the tree quality degrades when the
+     * shapes move far from where they were during the build.
+     * Hierarchies whose binary nodes were released by the node
+     * compression are rebuilt instead.
+     */
+    void refit();
+
+    /**
+     * \brief Discard the hierarchy and build it again over the
+     * registered shapes
+     *
+     * Unlike \ref clear(), the shapes stay registered. Use this when
+     * a refit is not good enough anymore.
+     */
+    void rebuild();
+
     /**
      * \brief Intersect a ray against all shapes registered
      * with the BVH
@@ -80,6 +258,61 @@ public:
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Find the closest hit, but leave the hit information to
+     * the caller
+     *
+     * Only <tt>its.t</tt>, <tt>its.uv</tt> (barycentric coordinates)
+     * and <tt>its.mesh</tt> are filled in. Calling
+     * <tt>its.mesh->setHitInformation(index, ray, its)</tt> completes
+     * the record; \ref Instance uses this to finish only the closest
+     * of its subscene hits.
+     *
+     * \param index
+     *    Receives the primitive index within <tt>its.mesh</tt>
+     */
+    bool rayIntersectDeferred(const Ray3f &ray, Intersection &its, uint32_t &index) const;
+
+    /**
+     * \brief Check whether any shape blocks the given ray segment
+     *
+     * Dedicated any-hit traversal for shadow rays: there is no closest
+     * hit bookkeeping, no \ref Intersection record and no child
+     * ordering, and it stops at the first primitive that is hit. This
+     * is what <tt>rayIntersect(ray, its, true)</tt> forwards to.
+     *
+     * \return \c true if the segment is occluded
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /// Number of rays that are traversed together by the batched query
+    static const uint32_t PACKET_SIZE = 16;
+
+    /**
+     * \brief Intersect a batch of rays against all shapes registered
+     * with the BVH
+     *
+     * The rays are traversed in packets of up to \ref PACKET_SIZE
+     * rays that share node fetches: a node is visited once for the
+     * whole packet and its bounding box is tested against all rays
+     * that are still active in that subtree. This pays off for
+     * coherent rays, e.g. the camera rays of an image block or the
+     * shadow rays towards a set of emitters.
+     *
+     * Packets only traverse the binary tree. With a branching factor
+     * of 4 or 8 (see \ref setWidth()), every ray is traced on its own
+     * through the wide nodes instead.
+     *
+     * \param its
+     *    Array of \c count intersection records. May be \c nullptr
+     *    when <tt>shadowRay</tt> is \c true.
+     * \param hit
+     *    Array of \c count flags that receive the per-ray result
+     *    (i.e. the return value of the single-ray version)
+     */
+    void rayIntersect(const Ray3f *rays, Intersection *its, bool *hit,
+        uint32_t count, bool shadowRay = false) const;
+
     /// Return the total number of shapes registered with the BVH
     uint32_t getShapeCount() const { return (uint32_t) m_shapes.size(); }
 
@@ -97,7 +330,56 @@ public:
         return m_bbox;
     }
 
+#if defined(NORI_BVH_COUNTERS)
+    /// Traversal work, summed over all BVHs
+    struct Counters {
+        uint64_t rays = 0;        ///< Top-level traversals
+        uint64_t nodes = 0;       ///< Node bounding box tests
+        uint64_t leaves = 0;      ///< Leaves visited
+        uint64_t primitives = 0;  ///< Primitive intersection tests
+        uint64_t culled = 0;      ///< Stack entries skipped because of their entry distance
+        uint64_t instances = 0;   ///< Traversals of an instanced subscene's BVH
+
+        Counters operator-(const Counters &c) const {
+            Counters result;
+            result.rays = rays - c.rays;
+            result.nodes = nodes - c.nodes;
+            result.leaves = leaves - c.leaves;
+            result.primitives = primitives - c.primitives;
+            result.culled = culled - c.culled;
+            result.instances = instances - c.instances;
+            return result;
+        }
+    };
+
+    /// Reset the process-wide traversal counters
+    static void resetCounters();
+
+    /// Return the process-wide traversal counters accumulated since the last reset
+    static Counters getCounters();
+
+    /**
+     * \brief Return the counters accumulated by the calling thread
+     *
+     * These are never reset: the work done for a single query is the
+     * difference of the values before and after it. Traversals of
+     * instanced subscenes count towards the ray that led to them.
+     */
+    static const Counters &getThreadCounters();
+
+    /**
+     * \brief Return a summary of the traversal counters accumulated
+     * by all BVHs since the last reset (rays, node visits, leaves,
+     * primitive tests, stack entries culled by their entry distance
+     * and instance transitions)
+     */
+    static std::string countersString();
+#endif
+
 protected:
+    /// Stream for build messages
+    std::ostream &log() const { return *m_log; }
+
     /**
      * \brief Compute the shape and primitive indices corresponding to
      * a primitive index used by the underlying generic BVH implementation. 
@@ -120,9 +402,30 @@ protected:
         return m_shapes[shapeIdx]->getCentroid(index);
     }
 
+    /// Number of intersection steps the SAH charges for a leaf with \c size primitives
+    uint32_t leafCost(uint32_t size) const {
+        uint32_t granularity = getLeafSize();
+        return (size + granularity - 1) / granularity;
+    }
+
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /// Run the selected builder; returns the SAH cost of the result
+    float construct();
+
+    /// Hash the input geometry and the build parameters into a cache key
+    uint64_t cacheKey() const;
+
+    /// Release the hierarchy, but keep the registered shapes
+    void clearHierarchy();
+
+    /// Try to fill \ref m_nodes and \ref m_indices from a cache file
+    bool loadCache(const std::string &filename, uint64_t key, float &sahCost);
+
+    /// Write \ref m_nodes and \ref m_indices to a cache file
+    void saveCache(const std::string &filename, uint64_t key, float sahCost) const;
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -162,11 +465,180 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /// Primitive reference with the owning shape already resolved
+    struct PrimitiveRef {
+        uint32_t shape;  ///< Index into \ref m_shapes
+        uint32_t index;  ///< Primitive index local to the shape
+    };
+
+    /// Triangle stored as one vertex and the two edges sharing it
+    struct PrecomputedTriangle {
+        Point3f p0;
+        Vector3f edge1, edge2;
+    };
+
+    /**
+     * \brief Up to \c N triangles of one leaf in SoA form
+     *
+     * Unused lanes have NaN vertices, which fail every edge test.
+     */
+    template <int N> struct alignas(32) TriangleBlock {
+        float p[3][3][N];     ///< Vertex positions: vertex, axis, lane
+        uint32_t prim[N];     ///< Index into \ref m_primitives per lane
+    };
+
+    /// Location of the triangle blocks of the leaf that starts at a given index
+    struct LeafBlocks {
+        uint32_t first;       ///< Index of the first block
+        uint32_t count;       ///< Number of blocks
+        uint32_t others;      ///< Number of primitives that are not mesh triangles
+    };
+
+    /**
+     * \brief Wide BVH node with \c N children
+     *
+     * The bounds of all children are stored as a structure of arrays
+     * (min x/y/z followed by max x/y/z), which lets the traversal code
+     * intersect them with one vectorized slab test. Unused slots have
+     * inverted bounds and can never be hit.
+     */
+    template <int N> struct alignas(64) BVHWideNode {
+        static const int Width = N;
+        typedef float Bounds[6][N];
+
+        Bounds bounds;        ///< Child bounds: min x/y/z, then max x/y/z
+        uint32_t child[N];    ///< Index of a wide node, or first index of a leaf
+        uint32_t count[N];    ///< Primitive count of leaf children, 0 otherwise
+
+        /// Return the child bounds (already in full precision)
+        const Bounds &decodeBounds(Bounds &) const { return bounds; }
+
+        /// Return a mask of the slots that may be hit
+        uint32_t validMask() const { return (1u << N) - 1; }
+    };
+
+    /**
+     * \brief Wide BVH node with quantized child bounds
+     *
+     * Child bounds are stored as integer multiples of a per-axis step
+     * relative to the minimum of the parent box. They are rounded
+     * outwards (with a few ulps of slack for the decoding arithmetic),
+     * so that the decoded boxes always contain the original ones.
+     */
+    template <int N, typename Q> struct BVHQuantizedNode {
+        static const int Width = N;
+        typedef float Bounds[6][N];
+
+        float origin[3];      ///< Decoded value of a zero offset per axis
+        float scale[3];       ///< Size of one quantization step per axis
+        Q bounds[6][N];       ///< Child bounds in steps: min x/y/z, then max x/y/z
+        uint32_t child[N];    ///< Index of a wide node, or first index of a leaf
+        uint32_t count[N];    ///< Primitive count of leaf children, 0 otherwise
+        uint32_t valid;       ///< Mask of the occupied slots
+
+        /// Decode the child bounds into \c result
+        const Bounds &decodeBounds(Bounds &result) const {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < N; ++i) {
+                    result[axis][i] = origin[axis] + bounds[axis][i] * scale[axis];
+                    result[axis + 3][i] = origin[axis] + bounds[axis + 3][i] * scale[axis];
+                }
+            }
+            return result;
+        }
+
+        /// Return a mask of the slots that may be hit
+        uint32_t validMask() const { return valid; }
+    };
+
+    /// Fill \ref m_triangles (or the triangle blocks) from the mesh shapes referenced by the leaves
+    void precomputeTriangles();
+
+    /// Fill \c blocks and \ref m_leafBlocks from the leaves of the binary tree
+    template <int N> void buildTriangleBlocks(std::vector<TriangleBlock<N>> &blocks);
+
+    /// Intersect the triangle blocks of a leaf (see \ref intersectLeaf())
+    template <int N> bool intersectBlocks(const std::vector<TriangleBlock<N>> &blocks,
+                                          const LeafBlocks &leaf, Ray3f &ray,
+                                          Intersection &its, uint32_t &f) const;
+
+    /// Return \c true as soon as one of the triangles in the blocks of a leaf is hit
+    template <int N> bool occludedBlocks(const std::vector<TriangleBlock<N>> &blocks,
+                                         const LeafBlocks &leaf, const Ray3f &ray) const;
+
+    /// Collapse the binary subtree rooted at \c node_idx into wide nodes
+    template <int N> uint32_t collapse(std::vector<BVHWideNode<N>> &nodes,
+                                       uint32_t node_idx) const;
+
+    /// Closest-hit traversal of the binary tree
+    bool rayIntersectBinary(Ray3f &ray, Intersection &its, uint32_t &f) const;
+
+    /// Reorder wide nodes into treelets of \ref m_treeletSize bytes
+    template <int N> void reorderTreelets(std::vector<BVHWideNode<N>> &nodes) const;
+
+    /// Convert the float wide nodes into quantized ones
+    template <int N, typename Q> void quantize(const std::vector<BVHWideNode<N>> &nodes,
+                                               std::vector<BVHQuantizedNode<N, Q>> &result) const;
+
+    /// Call \c func with the wide node array used for traversal
+    template <typename Func> bool visitWideNodes(const Func &func) const;
+
+    /// Closest-hit traversal of a collapsed wide tree
+    template <typename Node> bool rayIntersectWide(const std::vector<Node> &nodes,
+                                                   Ray3f &ray, Intersection &its, uint32_t &f) const;
+
+    /// Any-hit traversal of the binary tree
+    bool occludedBinary(const Ray3f &ray) const;
+
+    /// Any-hit traversal of a collapsed wide tree
+    template <typename Node> bool occludedWide(const std::vector<Node> &nodes,
+                                               const Ray3f &ray) const;
+
+    /// Packet traversal of the binary tree for up to \ref PACKET_SIZE rays
+    void rayIntersectPacket(const Ray3f *rays, Intersection *its, bool *hit,
+                            uint32_t count, bool shadowRay) const;
+
+    /**
+     * \brief Intersect the primitives <tt>m_primitives[start..end)</tt>
+     *
+     * Shrinks <tt>ray.maxt</tt> and fills in \c its and \c f whenever
+     * a closer hit is found.
+     *
+     * \return \c true if any of the primitives was hit
+     */
+    bool intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+                       Intersection &its, uint32_t &f) const;
+
+    /// Return \c true as soon as one of <tt>m_primitives[start..end)</tt> is hit
+    bool occludedLeaf(uint32_t start, uint32_t end, const Ray3f &ray) const;
 private:
     std::vector<Shape *> m_shapes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_shapeOffset; ///< Index of the first triangle for each shape
     std::vector<BVHNode> m_nodes;       ///< BVH nodes
     std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    std::vector<PrimitiveRef> m_primitives; ///< \ref m_indices resolved to (shape, primitive) pairs
+    std::vector<PrecomputedTriangle> m_triangles; ///< Triangle data in leaf order (optional)
+    std::vector<uint8_t> m_triangleShapes; ///< Per shape: is it covered by \ref m_triangles?
+    bool m_precomputeTriangles = false; ///< Build \ref m_triangles?
+    std::vector<TriangleBlock<4>> m_blocks4; ///< Triangle blocks in leaf order (if m_triangleWidth == 4)
+    std::vector<TriangleBlock<8>> m_blocks8; ///< Triangle blocks in leaf order (if m_triangleWidth == 8)
+    std::vector<LeafBlocks> m_leafBlocks; ///< Per leaf start index: its triangle blocks
+    uint32_t m_triangleWidth = 1;       ///< Triangles tested at a time
+    uint32_t m_leafSize = 0;            ///< Leaf granularity for the builders (0: triangle width)
+    EBuilder m_builder = ESAHBuilder;   ///< Construction algorithm
+    float m_splitBudget = 0.5f;         ///< Extra references allowed for spatial splits
+    std::string m_cacheDirectory;       ///< Where to cache built hierarchies (empty: disabled)
+    std::vector<BVHWideNode<4>> m_nodes4; ///< Collapsed 4-wide nodes (if m_width == 4)
+    std::vector<BVHWideNode<8>> m_nodes8; ///< Collapsed 8-wide nodes (if m_width == 8)
+    std::vector<BVHQuantizedNode<4, uint8_t>> m_nodes4q8;   ///< Quantized 4-wide nodes (8 bit)
+    std::vector<BVHQuantizedNode<4, uint16_t>> m_nodes4q16; ///< Quantized 4-wide nodes (16 bit)
+    std::vector<BVHQuantizedNode<8, uint8_t>> m_nodes8q8;   ///< Quantized 8-wide nodes (8 bit)
+    std::vector<BVHQuantizedNode<8, uint16_t>> m_nodes8q16; ///< Quantized 8-wide nodes (16 bit)
+    uint32_t m_compression = 0;         ///< Bits per quantized child bound (0: full precision)
+    uint32_t m_width = 2;               ///< Branching factor used for traversal
+    uint32_t m_treeletSize = 0;         ///< Bytes per treelet of wide nodes (0: depth-first order)
+    std::ostream *m_log = &std::cout;   ///< Where build messages go
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
 };
 
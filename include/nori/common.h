@@ -145,6 +145,9 @@ using std::endl;
 
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
+typedef Eigen::Matrix<uint16_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu16;
+typedef Eigen::Matrix<int16_t,  Eigen::Dynamic, Eigen::Dynamic> MatrixXs16;
+typedef Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic> MatrixXh;
 
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
@@ -195,6 +198,14 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/// 64 bit FNV-1a hash of a block of memory (e.g. for cache keys), continuing from \c hash
+extern uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
+/// 64 bit FNV-1a hash of a plain value, continuing from \c hash
+template <typename T> uint64_t hashValue(const T &value, uint64_t hash = 0xcbf29ce484222325ull) {
+    return hashBytes(&value, sizeof(T), hash);
+}
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
@@ -24,6 +24,26 @@ public:
         } else {
             m_emitter = nullptr;
         }
+        updateBoundingBox();
+    }
+
+    bool linked() {return m_subscene;}
+
+    /**
+     * \brief Move the instance, e.g. for the next frame of an animation
+     *
+     * The enclosing scene's BVH needs a \ref BVH::refit() (or a
+     * rebuild) afterwards; the subscene's BVH is not affected.
+     */
+    void setTransform(const Transform &toWorld) {
+        m_ToWorld = toWorld;
+        m_ToLocal = toWorld.inverse();
+        if (m_subscene)
+            updateBoundingBox();
+    }
+
+    /// Recompute the world space bounds from the subscene's bounds
+    void updateBoundingBox() {
         m_bbox = BoundingBox3f();
         BoundingBox3f og_bbox = m_subscene->getBoundingBox();
         for (int i = 0; i < 8; i++) {
@@ -31,8 +51,6 @@ public:
         }
     }
 
-    bool linked() {return m_subscene;}
-
 
     int getSubsceneId() {
         return m_subsceneID;
@@ -95,24 +113,51 @@ public:
     virtual EClassType getClassType() const override {return EInstance;}
 
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
+        uint32_t hitIndex;
+        return rayIntersectDeferred(index, ray, u, v, t, hitIndex);
+    }
+
+    /// Trace the subscene once and report the hit triangle as \c hitIndex
+    virtual bool rayIntersectDeferred(uint32_t index, const Ray3f &ray, float &u, float &v,
+                                      float &t, uint32_t &hitIndex) const override {
+        /* The local ray direction is not normalized, so t carries over */
         Intersection its;
-        bool found_intersection = m_subscene->rayIntersect(toLocal(ray), its);
-        //bool found_intersection = m_subscene->getMesh()->rayIntersect(index, toLocal(ray), u, v, t);
+        if (!m_subscene->rayIntersectDeferred(toLocal(ray), its, hitIndex))
+            return false;
         u = its.uv.x();
         v = its.uv.y();
         t = its.t;
-        return found_intersection;
+        return true;
     }
 
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const {
+        return m_subscene->occluded(toLocal(ray));
+    }
+
+    /**
+     * \c index is the subscene triangle reported by \ref rayIntersectDeferred().
+     * The hit reports the subscene's mesh, which carries the BSDF, emitter
+     * and media that this instance shares
+     */
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
-        m_subscene->rayIntersect(toLocal(ray), its);
-        its.p = toWorld(its.p);
-        its.geoFrame = Frame(toWorld(its.geoFrame.n));
-        its.shFrame = Frame(toWorld(its.shFrame.n));
-        /*m_subscene->getMesh()->setHitInformation(index, toLocal(ray), its);
+        const Shape *mesh = m_subscene->getMesh();
+        mesh->setHitInformation(index, toLocal(ray), its);
+        its.mesh = mesh;
         its.p = toWorld(its.p);
-        its.geoFrame = Frame(toWorld(its.geoFrame.n));
-        its.shFrame = Frame(toWorld(its.shFrame.n));*/
+        its.dpdu = toWorld(its.dpdu);
+        its.dpdv = toWorld(its.dpdv);
+        its.geoFrame = toWorld(its.geoFrame);
+        its.shFrame = toWorld(its.shFrame);
+        its.computeDifferentials(ray);
+    }
+
+    /// Transform a frame, keeping its tangent where the transform put it
+    Frame toWorld(const Frame &frame) const {
+        Normal3f n = toWorld(frame.n).normalized();
+        Vector3f s = toWorld(frame.s);
+        /* Non-uniform scales skew the tangent, project it back */
+        s = (s - n * n.dot(s)).normalized();
+        return Frame(s, n.cross(s), n);
     }
 
     Point3f getCentroid(uint32_t index) const {
@@ -22,6 +22,7 @@
 #include <nori/shape.h>
 #include <nori/dpdf.h>
 #include <nori/lightcone.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -35,11 +36,78 @@ NORI_NAMESPACE_BEGIN
  */
 class Mesh : public Shape {
 public:
+    /**
+     * \brief Vertex and index buffers of a mesh
+     *
+     * Meshes loaded from the same source (e.g. one OBJ file referenced
+     * by several subscenes) share a single copy, see \ref GeometryRegistry.
+     *
+     * Normals, texture coordinates and faces can be stored in a compact
+     * form instead (see \ref compact()); at most one of each pair of
+     * matrices is set. The accessors below work with either layout.
+     */
+    struct Geometry {
+        MatrixXf V;    ///< Vertex positions
+        MatrixXf N;    ///< Vertex normals
+        MatrixXf UV;   ///< Vertex texture coordinates
+        MatrixXu F;    ///< Faces
+
+        MatrixXs16 Noct; ///< Octahedral-encoded vertex normals (2 x 16 bit, signed normalized)
+        MatrixXh UVh;    ///< Half-precision vertex texture coordinates
+        MatrixXu16 F16;  ///< Faces with 16-bit indices
+
+        /// References held by shared BVHs (see \ref GeometryRegistry) rather than by meshes
+        uint32_t bvhReferences = 0;
+
+        /// Return the number of triangles
+        uint32_t getFaceCount() const {
+            return (uint32_t) (F16.size() > 0 ? F16.cols() : F.cols());
+        }
+
+        /// Return the index of vertex \c corner (0..2) of triangle \c face
+        uint32_t getIndex(uint32_t corner, uint32_t face) const {
+            return F16.size() > 0 ? (uint32_t) F16(corner, face) : F(corner, face);
+        }
+
+        /// Are there per-vertex normals?
+        bool hasNormals() const { return N.size() > 0 || Noct.size() > 0; }
+
+        /// Are there per-vertex texture coordinates?
+        bool hasTexCoords() const { return UV.size() > 0 || UVh.size() > 0; }
+
+        /// Return the (unit length) normal of the given vertex
+        Normal3f getNormal(uint32_t vertex) const;
+
+        /// Return the texture coordinates of the given vertex
+        Point2f getTexCoord(uint32_t vertex) const {
+            if (UVh.size() > 0)
+                return Point2f((float) UVh(0, vertex), (float) UVh(1, vertex));
+            return UV.col(vertex);
+        }
+
+        /**
+         * \brief Switch to the compact layout
+         *
+         * \param normals
+         *    Store normals octahedral-encoded in two 16-bit values
+         * \param texCoords
+         *    Store texture coordinates as half-precision floats
+         * \param indices
+         *    Store faces with 16-bit indices; ignored for meshes
+         *    with more than 65536 vertices
+         * \return The number of bytes saved
+         */
+        size_t compact(bool normals, bool texCoords, bool indices);
+
+        /// Return the memory used by all buffers in bytes
+        size_t getMemoryUsage() const;
+    };
+
     /// Initialize internal data structures (called once by the XML parser)
     virtual void activate() override;
 
     /// Return the total number of triangles in this shape
-    virtual uint32_t getPrimitiveCount() const override { return (uint32_t) m_F.cols(); }
+    virtual uint32_t getPrimitiveCount() const override { return m_geometry->getFaceCount(); }
 
     //// Return an axis-aligned bounding box containing the given triangle
     virtual BoundingBox3f getBoundingBox(uint32_t index) const override;
@@ -80,11 +148,23 @@ public:
      */
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
 
+    /**
+     * \brief Moeller-Trumbore test against a triangle given by one
+     * vertex and the two edges sharing it
+     *
+     * This is the kernel behind \ref rayIntersect(); it is exposed so
+     * that \ref BVH can run it on triangle data it has precomputed
+     * in leaf order.
+     */
+    static bool rayIntersectTriangle(const Point3f &p0, const Vector3f &edge1,
+                                     const Vector3f &edge2, const Ray3f &ray,
+                                     float &u, float &v, float &t);
+
     /// Set intersection information: hit point, shading frame, UVs
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
 
     /// Return the total number of vertices in this shape
-    uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
+    uint32_t getVertexCount() const { return (uint32_t) m_geometry->V.cols(); }
 
     /**
      * \brief Uniformly sample a position on the mesh with
@@ -100,16 +180,39 @@ public:
     Normal3f getInterpolatedNormal(uint32_t index, const Vector3f & bc) const;
 
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    const MatrixXf &getVertexPositions() const { return m_geometry->V; }
+
+    /**
+     * \brief Replace the vertex positions, e.g. for the next frame of
+     * an animation
+     *
+     * The connectivity stays the same, so \c V must have as many
+     * columns as there are vertices. Updates the bounding box and the
+     * area sampling table. Geometry shared with other meshes is copied
+     * first, so they keep the old positions; references held by shared
+     * BVHs do not count, since only subscenes over this mesh use those
+     * BVHs then. A subscene over this mesh
+     * needs a \ref SubScene::refit() afterwards, other BVHs containing
+     * it a \ref BVH::refit().
+     */
+    void setVertexPositions(const MatrixXf &V);
+
+    /// Return a pointer to the vertex normals (empty if there are none or if they are compact)
+    const MatrixXf &getVertexNormals() const { return m_geometry->N; }
+
+    /// Return a pointer to the texture coordinates (empty if there are none or if they are compact)
+    const MatrixXf &getVertexTexCoords() const { return m_geometry->UV; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    /// Return a pointer to the triangle vertex index list (empty if it uses 16-bit indices)
+    const MatrixXu &getIndices() const { return m_geometry->F; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    /// Return the index of vertex \c corner (0..2) of the given triangle, in either layout
+    uint32_t getVertexIndex(uint32_t corner, uint32_t index) const {
+        return m_geometry->getIndex(corner, index);
+    }
 
-    /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    /// Return the vertex and index buffers (possibly shared with other meshes)
+    const std::shared_ptr<Geometry> &getGeometry() const { return m_geometry; }
 
 
     /// Return the name of this mesh
@@ -124,10 +227,7 @@ protected:
 
 protected:
     std::string m_name;                  ///< Identifying name
-    MatrixXf      m_V;                   ///< Vertex positions
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces
+    std::shared_ptr<Geometry> m_geometry; ///< Vertex data (possibly shared)
 
     DiscretePDF m_pdf;
     struct LightCone m_cone;
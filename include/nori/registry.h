@@ -0,0 +1,143 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_REGISTRY_H)
+#define __NORI_REGISTRY_H
+
+#include <nori/mesh.h>
+#include <nori/bvh.h>
+#include <nori/texture.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Process-wide registry of shared geometry and bottom-level BVHs
+ *
+ * Meshes that are loaded from the same source (file name and load-time
+ * transform) share a single \ref Mesh::Geometry, and subscenes over the
+ * same geometry with the same BVH settings share a single BVH. Entries
+ * only hold weak references, so they go away with the last user.
+ *
+ * Subscenes merely register their BVHs; \ref buildPending() then builds
+ * all distinct ones concurrently. \ref Scene::activate() does this
+ * before it builds the top-level hierarchy.
+ */
+class GeometryRegistry {
+public:
+    /// Return the process-wide registry
+    static GeometryRegistry &get();
+
+    /// Return geometry registered under \c key, or \c nullptr
+    std::shared_ptr<Mesh::Geometry> findGeometry(const std::string &key);
+
+    /**
+     * \brief Make \c geometry available to later meshes loaded from the same source
+     *
+     * Meshes may be loaded concurrently, so another one may have
+     * registered the same source in the meantime. In that case, its
+     * geometry is returned and should be used instead of \c geometry.
+     */
+    std::shared_ptr<Mesh::Geometry> addGeometry(const std::string &key,
+                                                const std::shared_ptr<Mesh::Geometry> &geometry);
+
+    /**
+     * \brief Return a BVH over \c shape for the given build settings
+     *
+     * Reuses an earlier BVH if a mesh with the same geometry was
+     * registered with identical \c settings. Otherwise, \c configure is
+     * called on a new BVH and the build is deferred to \ref buildPending().
+     *
+     * A new BVH over a mesh is built over a separate mesh object that
+     * holds its own reference to the geometry, so it is not affected when
+     * any of the sharing meshes is changed later on (\ref
+     * Mesh::setVertexPositions() copies shared geometry before writing).
+     * Other shapes are added to the new BVH themselves, which then owns them.
+     *
+     * \param settings
+     *    String that uniquely describes the build settings
+     */
+    std::shared_ptr<BVH> acquireBVH(Shape *shape, const std::string &settings,
+                                    const std::function<void(BVH *)> &configure);
+
+    /// Build all BVHs that were registered since the last call, concurrently
+    void buildPending();
+
+private:
+    typedef std::pair<const void *, std::string> BVHKey;
+
+    std::mutex m_mutex;
+    std::map<std::string, std::weak_ptr<Mesh::Geometry>> m_geometry;
+    std::map<BVHKey, std::weak_ptr<BVH>> m_bvhs;
+    std::vector<std::shared_ptr<BVH>> m_pending;
+    size_t m_requests = 0;  ///< Number of acquireBVH() calls since the last build
+};
+
+/**
+ * \brief Process-wide registry of decoded textures
+ *
+ * Textures that load the same image file with the same channel type
+ * and wrap mode share a single decoded copy (e.g. a mip pyramid), no
+ * matter which scale and offset they apply to it. Like the geometry
+ * registry, it only holds weak references, so that every entry is
+ * freed together with the last texture using it.
+ */
+class TextureRegistry {
+public:
+    /// Return the process-wide registry
+    static TextureRegistry &get();
+
+    /**
+     * \brief Return the data decoded from \c filename
+     *
+     * If no texture with the same file name, channel type and wrap
+     * mode is alive, \c load is called to decode it. Textures may be
+     * loaded concurrently, in which case the first copy that is
+     * registered wins.
+     */
+    template <typename Data>
+    std::shared_ptr<const Data> acquire(const std::string &filename, const std::string &channels,
+                                        const std::string &wrap,
+                                        const std::function<std::shared_ptr<Data>()> &load) {
+        Key key(filename, channels, wrap);
+        std::shared_ptr<const TextureData> data = find(key);
+        if (!data)
+            data = add(key, load());
+        return std::static_pointer_cast<const Data>(data);
+    }
+
+    /// Print the shared textures that are currently alive and their memory usage
+    void printSummary();
+
+private:
+    typedef std::tuple<std::string, std::string, std::string> Key;
+
+    std::shared_ptr<const TextureData> find(const Key &key);
+    std::shared_ptr<const TextureData> add(const Key &key, const std::shared_ptr<const TextureData> &data);
+
+    std::mutex m_mutex;
+    std::map<Key, std::weak_ptr<const TextureData>> m_textures;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_REGISTRY_H */
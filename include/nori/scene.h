@@ -115,8 +115,58 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_bvh->rayIntersect(ray, its, true);
+        return m_bvh->occluded(ray);
+    }
+
+    /**
+     * \brief Check whether the given shadow ray segment is blocked
+     *
+     * Runs the dedicated any-hit traversal of the BVH, which neither
+     * creates an \ref Intersection record nor searches for the
+     * closest hit. Next event estimation should use this.
+     *
+     * \return \c true if anything lies between <tt>ray.mint</tt>
+     *    and <tt>ray.maxt</tt>
+     */
+    bool occluded(const Ray3f &ray) const {
+        return m_bvh->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a batch of rays against all triangles stored in
+     * the scene and return detailed intersection information
+     *
+     * The rays are traced as packets that share BVH node visits, which
+     * amortizes traversal for coherent rays such as the camera rays of
+     * an image block.
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled
+     *    by the intersection query
+     *
+     * \param hit
+     *    Array of \c count flags that receive whether an intersection
+     *    was found for the corresponding ray
+     */
+    void rayIntersect(const Ray3f *rays, Intersection *its, bool *hit, uint32_t count) const {
+        m_bvh->rayIntersect(rays, its, hit, count, false);
+    }
+
+    /**
+     * \brief Batched version of the shadow ray query
+     *
+     * Determines for each of the \c count rays whether there is an
+     * intersection, e.g. for the shadow rays of next event estimation
+     * towards several emitters.
+     *
+     * \param occluded
+     *    Array of \c count flags that receive the per-ray result
+     */
+    void rayIntersect(const Ray3f *rays, bool *occluded, uint32_t count) const {
+        m_bvh->rayIntersect(rays, nullptr, occluded, count, true);
     }
 
     bool rayIntersectTr(Ray3f& ray, Color3f &tr) const {
@@ -143,6 +193,24 @@ public:
         return m_bvh->getBoundingBox();
     }
 
+    /// Return the subscenes that instances refer to
+    const std::vector<SubScene *> &getSubScenes() const { return m_subscenes; }
+
+    /**
+     * \brief Update the top-level BVH after instances or meshes moved
+     *
+     * Only refits the node bounds of the top-level hierarchy; the
+     * subscene BVHs are left alone, so moving instances around costs
+     * time proportional to the number of instances. Subscenes whose
+     * meshes were deformed must be refit on their own (and before
+     * this call, since the instance bounds depend on them).
+     *
+     * \param rebuild
+     *    Rebuild the top-level hierarchy from scratch instead, which
+     *    restores the tree quality after large motions
+     */
+    void update(bool rebuild = false);
+
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
@@ -176,6 +176,12 @@ public:
     /// Return a pointer to an attached area emitter instance (const version)
     const Emitter *getEmitter() const { return m_emitter; }
 
+    /// Append the area emitters of this shape (and of any shapes it is made of)
+    virtual void getEmitters(std::vector<Emitter *> &emitters) {
+        if (m_emitter)
+            emitters.push_back(m_emitter);
+    }
+
     /// Return a pointer to the BSDF associated with this mesh
     const BSDF *getBSDF() const { return m_bsdf; }
 
@@ -200,6 +206,26 @@ public:
     //// Ray-Shape intersection test
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const = 0;
 
+    /**
+     * \brief Ray-Shape intersection test for shapes made of parts
+     *
+     * Like \ref rayIntersect(), but \c hitIndex receives the index
+     * that \ref setHitInformation() must be called with later. This
+     * is \c index itself unless the shape (e.g. an \ref Instance)
+     * contains primitives of its own.
+     */
+    virtual bool rayIntersectDeferred(uint32_t index, const Ray3f &ray, float &u, float &v,
+                                      float &t, uint32_t &hitIndex) const {
+        hitIndex = index;
+        return rayIntersect(index, ray, u, v, t);
+    }
+
+    //// Ray-Shape occlusion test (any hit along the segment will do)
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const {
+        float u, v, t;
+        return rayIntersect(index, ray, u, v, t);
+    }
+
     /// Set the intersection information: hit point, shading frame, UVs, etc.
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const = 0;
 
@@ -5,6 +5,7 @@
 #include <nori/shape.h>
 #include <nori/bvh.h>
 #include <nori/lightbvh.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -27,14 +28,38 @@ public:
     virtual std::string toString() const override;
 
     bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        return m_bvh->rayIntersect(ray, its, false);
+        /* The BVH may be shared with a subscene over the same geometry */
+        bool found = m_bvh->rayIntersect(ray, its, false);
+        its.mesh = m_mesh;
+        return found;
+    }
+
+    /// Closest hit without hit information (see \ref BVH::rayIntersectDeferred())
+    bool rayIntersectDeferred(const Ray3f &ray, Intersection &its, uint32_t &index) const {
+        return m_bvh->rayIntersectDeferred(ray, its, index);
     }
 
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_bvh->rayIntersect(ray, its, true);
+        return m_bvh->occluded(ray);
+    }
+
+    bool occluded(const Ray3f &ray) const {
+        return m_bvh->occluded(ray);
     }
 
+    /**
+     * \brief Update the BVH after the vertices of the mesh were changed
+     *
+     * Only this subscene sees the change: \ref Mesh::setVertexPositions()
+     * first copies geometry that is shared with other meshes, and the
+     * shared BVH (see \ref GeometryRegistry) keeps the old geometry for the
+     * other subscenes. In that case, this subscene switches to a private
+     * BVH over its new geometry, which takes a full build; later calls
+     * refit the private BVH. A mesh that no other mesh shares geometry
+     * with is changed in place, and its BVH is simply refit.
+     */
+    void refit();
+
     virtual BoundingBox3f getBoundingBox() const {
         return m_mesh->getBoundingBox();
     }
@@ -44,9 +69,16 @@ public:
     }
 
 protected:
+    /// Look up the (possibly shared) BVH for \ref m_mesh
+    void acquireBVH();
+
+    /// Apply the BVH settings given in the subscene's properties
+    void configureBVH(BVH *bvh) const;
+
     int m_id;
     Shape *m_mesh = nullptr;
-    BVH *m_bvh = nullptr;
+    PropertyList m_props;         ///< Kept for the BVH settings
+    std::shared_ptr<BVH> m_bvh;   ///< Possibly shared, see \ref GeometryRegistry
     LightBVH *m_lbvh = nullptr;
 };
 
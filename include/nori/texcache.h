@@ -0,0 +1,179 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_TEXCACHE_H)
+#define __NORI_TEXCACHE_H
+
+#include <nori/mmap.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Process-wide cache of texture tiles with a bounded memory budget
+ *
+ * Tiled textures keep their mip levels in a tile file on disk and only
+ * bring in the tiles that lookups actually touch. All render threads
+ * share the resident tiles, which are split over several independently
+ * locked shards, each evicting its least recently used tiles once it
+ * exceeds its part of the budget.
+ *
+ * In front of the shards, every thread keeps the few tiles it used
+ * last, so that the lookups of a texture filter, which mostly hit the
+ * same tiles over and over, need no lock at all. These tiles stay alive
+ * even if the shared part evicts them, so a tile that a lookup is still
+ * reading remains valid; the memory they take is not part of the budget.
+ */
+class TextureCache {
+public:
+    /// Texels per side of a tile
+    static constexpr int TILE_SIZE = 64;
+
+    /// Raw texel data of a single tile
+    typedef std::vector<uint8_t> Tile;
+
+    /// Tile usage since the last call to \ref resetStatistics()
+    struct Statistics {
+        uint64_t hits = 0;        ///< Lookups of resident tiles
+        uint64_t localHits = 0;   ///< Hits among them on a thread's recent tiles (counted in batches)
+        uint64_t misses = 0;      ///< Lookups that had to load a tile
+        uint64_t evictions = 0;   ///< Tiles dropped to stay within the budget
+        double stallTime = 0;     ///< Total time spent loading tiles (ms, summed over threads)
+    };
+
+    /// Return the process-wide cache
+    static TextureCache &get();
+
+    /// Set the memory budget for resident tiles in bytes
+    void setBudget(size_t budget);
+
+    /// Return the memory budget for resident tiles in bytes
+    size_t getBudget() const { return m_budget; }
+
+    /**
+     * \brief Register a tile file
+     *
+     * \param offset
+     *    Position of the first tile in the file
+     * \param tileBytes
+     *    Size of a single tile; tiles are stored consecutively
+     * \return
+     *    Identifier to pass to \ref getTile()
+     */
+    uint32_t addSource(std::unique_ptr<MemoryMappedFile> file, size_t offset, size_t tileBytes);
+
+    /// Drop a tile file and all of its resident tiles
+    void removeSource(uint32_t source);
+
+    /**
+     * \brief Return a tile of the given source, loading it if it is not resident
+     *
+     * The tile remains valid at least until the calling thread's
+     * next call to this function.
+     */
+    const Tile *getTile(uint32_t source, uint32_t index);
+
+    /// Return the memory used by resident tiles in bytes
+    size_t getMemoryUsage();
+
+    /// Reset the tile usage statistics
+    void resetStatistics();
+
+    /// Return the tile usage statistics accumulated since the last reset
+    Statistics getStatistics();
+
+    /// Return a summary of the tile usage statistics, or an empty string if no tiles were used
+    std::string statisticsString();
+
+private:
+    static constexpr int SHARD_COUNT = 16;
+
+    /// Number of recently used tiles that every thread keeps to itself
+    static constexpr int LOCAL_TILE_COUNT = 16;
+
+    /// Hits on the recent tiles of a thread that are added up before they are counted
+    static constexpr uint32_t LOCAL_HIT_BATCH = 1024;
+
+    struct Source {
+        std::unique_ptr<MemoryMappedFile> file;
+        size_t offset;
+        size_t tileBytes;
+        std::atomic<uint32_t> generation { 0 };  ///< Bumped when the source is removed
+    };
+
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<const Tile> tile;
+        std::shared_ptr<const Source> source;
+    };
+
+    /// Tiles that a thread used recently, checked before the shards
+    struct LocalTiles {
+        struct {
+            uint64_t key = (uint64_t) -1;
+            uint32_t generation = 0;
+            std::shared_ptr<const Source> source;
+            std::shared_ptr<const Tile> tile;
+        } entries[LOCAL_TILE_COUNT];
+        int next = 0;        ///< Entry that is replaced next
+        uint32_t hits = 0;   ///< Hits not yet added to \ref m_localHits
+    };
+
+    /// Independently locked part of the cache, most recently used tiles first
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> entries;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        size_t memory = 0;
+        uint64_t hits = 0, misses = 0, evictions = 0;
+    };
+
+    static uint64_t makeKey(uint32_t source, uint32_t index) {
+        return ((uint64_t) source << 32) | index;
+    }
+
+    Shard &shard(uint64_t key) {
+        return m_shards[((key * 0x9E3779B97F4A7C15ull) >> 32) % SHARD_COUNT];
+    }
+
+    /// Look up a tile in the shards, loading it if it is not resident
+    std::shared_ptr<const Tile> findTile(uint32_t source, uint32_t index,
+                                         std::shared_ptr<const Source> &src);
+
+    /// Drop least recently used tiles until the shard is within its budget (requires the shard's lock)
+    void evict(Shard &shard);
+
+    Shard m_shards[SHARD_COUNT];
+    std::atomic<size_t> m_budget { (size_t) 256 << 20 };
+    std::atomic<uint64_t> m_stallTime { 0 };  ///< In nanoseconds
+    std::atomic<uint64_t> m_localHits { 0 };
+
+    std::mutex m_sourceMutex;
+    std::map<uint32_t, std::shared_ptr<Source>> m_sources;
+    uint32_t m_nextSource = 0;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_TEXCACHE_H */
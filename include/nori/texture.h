@@ -24,6 +24,22 @@
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Decoded image data that can be shared between textures
+ *
+ * See \ref TextureRegistry.
+ */
+class TextureData {
+public:
+    virtual ~TextureData() { }
+
+    /// Return the memory used by the decoded data in bytes
+    virtual size_t getMemoryUsage() const = 0;
+
+    /// Return a short description of the data (e.g. its resolution)
+    virtual std::string toString() const = 0;
+};
+
 /**
  * \brief Superclass of all texture
  */
@@ -78,7 +78,9 @@ with open('./wood_scene.xml', 'w') as f:
 			<translate value="10,0,25"/>
 		</transform>
 	</mesh>
-""" + emitters + """
+	<!-- All emitting spheres in a single shape, each keeping its own BSDF and emitter -->
+	<mesh type="sphereset">""" + emitters + """
+	</mesh>
 	
 
 	<subscene type="subscene">
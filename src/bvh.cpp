@@ -17,15 +17,130 @@
 */
 
 #include <nori/bvh.h>
+#include <nori/mesh.h>
 #include <nori/timer.h>
+#include <nori/mmap.h>
+#include <filesystem/path.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define NORI_BVH_SSE 1
+#  include <immintrin.h>
+#endif
 
+#if defined(__AVX__)
+#  define NORI_BVH_AVX 1
+#endif
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
 
 NORI_NAMESPACE_BEGIN
 
+/// Return the index of the lowest set bit of a nonzero mask
+static inline int lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+#if defined(NORI_BVH_COUNTERS)
+static std::atomic<uint64_t> s_rayCount(0), s_nodeCount(0), s_leafCount(0),
+    s_primitiveCount(0), s_culledCount(0), s_instanceCount(0);
+
+/// Per-thread totals (for per-pixel statistics) and the current traversal depth
+static thread_local BVH::Counters t_counters;
+static thread_local int t_depth = 0;
+#endif
+
+/**
+ * Per-ray traversal counters. They are accumulated locally and only
+ * flushed to the global atomics once the ray is done, so that the
+ * instrumented build stays usable. A traversal that starts while
+ * another one is running on the same thread is an instance transition
+ * rather than a new ray. A packet traversal counts as one ray per
+ * active packet entry, and its counters sum up over those rays. Without
+ * \c NORI_BVH_COUNTERS everything compiles away.
+ */
+struct TraversalCounters {
+#if defined(NORI_BVH_COUNTERS)
+    uint64_t rays, nodes = 0, leaves = 0, primitives = 0, culled = 0;
+    bool nested;
+
+    TraversalCounters(uint32_t rays = 1) : rays(rays), nested(t_depth++ > 0) { }
+
+    void node() { ++nodes; }
+    void leaf(uint32_t count) { ++leaves; primitives += count; }
+    void cull() { ++culled; }
+
+    ~TraversalCounters() {
+        --t_depth;
+        if (nested) {
+            s_instanceCount += rays;
+            t_counters.instances += rays;
+        } else {
+            s_rayCount += rays;
+            t_counters.rays += rays;
+        }
+        s_nodeCount += nodes;
+        s_leafCount += leaves;
+        s_primitiveCount += primitives;
+        s_culledCount += culled;
+        t_counters.nodes += nodes;
+        t_counters.leaves += leaves;
+        t_counters.primitives += primitives;
+        t_counters.culled += culled;
+    }
+#else
+    TraversalCounters(uint32_t = 1) { }
+    void node() { }
+    void leaf(uint32_t) { }
+    void cull() { }
+#endif
+};
+
+#if defined(NORI_BVH_COUNTERS)
+void BVH::resetCounters() {
+    s_rayCount = s_nodeCount = s_leafCount = s_primitiveCount = s_culledCount = s_instanceCount = 0;
+}
+
+BVH::Counters BVH::getCounters() {
+    Counters result;
+    result.rays = s_rayCount;
+    result.nodes = s_nodeCount;
+    result.leaves = s_leafCount;
+    result.primitives = s_primitiveCount;
+    result.culled = s_culledCount;
+    result.instances = s_instanceCount;
+    return result;
+}
+
+const BVH::Counters &BVH::getThreadCounters() {
+    return t_counters;
+}
+
+std::string BVH::countersString() {
+    Counters counters = getCounters();
+    double scale = counters.rays > 0 ? 1.0 / (double) counters.rays : 0.0;
+    return tfm::format(
+        "BVH traversal: %llu rays, %.2f nodes/ray, %.2f leaves/ray, %.2f primitives/ray, "
+        "%.2f culled/ray, %.2f instances/ray",
+        (unsigned long long) counters.rays, counters.nodes * scale, counters.leaves * scale,
+        counters.primitives * scale, counters.culled * scale, counters.instances * scale);
+}
+#endif
+
 /* Bin data structure for counting triangles and computing their bounding box */
 struct Bins {
     static const int BIN_COUNT = 16;
@@ -145,14 +260,14 @@ public:
 
         BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1], best_bbox_right;
         int64_t best_index = -1;
-        float best_cost = (float) INTERSECTION_COST * size;
+        float best_cost = (float) INTERSECTION_COST * bvh.leafCost(size);
         float tri_factor = (float) INTERSECTION_COST / node.bbox.getSurfaceArea();
 
         for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
             uint32_t prims_left = bins.counts[i], prims_right = (uint32_t) (end - start) - bins.counts[i];
             float sah_cost = 2.0f * TRAVERSAL_COST +
-                tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-                              prims_right * bbox_right.getSurfaceArea());
+                tri_factor * (bvh.leafCost(prims_left) * bbox_left[i].getSurfaceArea() +
+                              bvh.leafCost(prims_right) * bbox_right.getSurfaceArea());
             if (sah_cost < best_cost) {
                 best_cost = sah_cost;
                 best_index = i;
@@ -229,7 +344,7 @@ public:
     static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
         BVH::BVHNode &node = bvh.m_nodes[node_idx];
         uint32_t size = (uint32_t) (end - start);
-        float best_cost = (float) INTERSECTION_COST * size;
+        float best_cost = (float) INTERSECTION_COST * bvh.leafCost(size);
         int64_t best_index = -1, best_axis = -1;
         float *left_areas = (float *) temp;
 
@@ -263,8 +378,8 @@ public:
                 uint32_t prims_right = size-i;
 
                 float sah_cost = 2.0f * TRAVERSAL_COST +
-                    tri_factor * (prims_left * left_area +
-                                  prims_right * right_area);
+                    tri_factor * (bvh.leafCost(prims_left) * left_area +
+                                  bvh.leafCost(prims_right) * right_area);
 
                 if (sah_cost < best_cost) {
                     best_cost = sah_cost;
@@ -298,160 +413,2327 @@ public:
     }
 };
 
-void BVH::addShape(Shape *shape) {
-    m_shapes.push_back(shape);
-    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
-    m_bbox.expandBy(shape->getBoundingBox());
+/**
+ * \brief Serial builder for a BVH with spatial splits (SBVH)
+ *
+ * Follows "Spatial Splits in Bounding Volume Hierarchies" by Martin Stich,
+ * Heiko Friedrich and Andreas Dietrich (Proc. High Performance Graphics 2009).
+ *
+ * Besides the binned object splits used by \ref BVHBuildTask, nodes whose
+ * children would overlap noticeably also try to split space into bins.
+ * Triangles that straddle the chosen plane are clipped against it and end
+ * up with one reference on each side, unless keeping them whole on one side
+ * is cheaper. The total number of references is capped by the split budget.
+ *
+ * Nodes are emitted depth-first (the left child always directly follows its
+ * parent), so the node array needs no compactification afterwards.
+ */
+class SBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Number of bins for object and spatial splits
+        BIN_COUNT = 32,
+
+        /// Make a leaf regardless of cost below this depth (traversal stacks hold 64 entries)
+        MAX_DEPTH = 60
+    };
+
+    /// Primitive reference, possibly clipped to a part of the primitive's bounding box
+    struct Reference {
+        uint32_t index;
+        BoundingBox3f bbox;
+    };
+
+    SBVHBuilder(BVH &bvh, float splitBudget) : bvh(bvh), splitBudget(splitBudget) { }
+
+    void build() {
+        uint32_t size = bvh.getPrimitiveCount();
+
+        meshes.resize(bvh.m_shapes.size());
+        for (size_t i = 0; i < bvh.m_shapes.size(); ++i)
+            meshes[i] = dynamic_cast<const Mesh *>(bvh.m_shapes[i]);
+
+        std::vector<Reference> refs(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    refs[i] = Reference { i, bvh.getBoundingBox(i) };
+            }
+        );
+
+        referenceCount = size;
+        maxReferences = size + (uint64_t) (std::max(splitBudget, 0.f) * size);
+        minOverlap = 1e-5f * bvh.m_bbox.getSurfaceArea();
+
+        bvh.m_nodes.clear();
+        bvh.m_indices.clear();
+        bvh.m_nodes.reserve(2 * size);
+        bvh.m_indices.reserve(size);
+
+        buildNode(refs, 0);
+
+        bvh.m_nodes.shrink_to_fit();
+        bvh.m_indices.shrink_to_fit();
+    }
+
+    /// Number of references created by spatial splits
+    uint64_t getDuplicateCount() const { return referenceCount - bvh.getPrimitiveCount(); }
+
+private:
+    /// Candidate split found by one of the two binning passes
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        int bin = -1;           ///< Last bin on the left side
+        float min = 0.f, binSize = 0.f;
+        BoundingBox3f bboxLeft, bboxRight;
+
+        /// Position of the split plane (spatial splits)
+        float plane() const { return min + (bin + 1) * binSize; }
+    };
+
+    uint32_t buildNode(std::vector<Reference> &refs, int depth) {
+        uint32_t node_idx = (uint32_t) bvh.m_nodes.size();
+        bvh.m_nodes.push_back(BVH::BVHNode());
+
+        uint32_t size = (uint32_t) refs.size();
+        BoundingBox3f bbox, centroids;
+        for (const Reference &ref : refs) {
+            bbox.expandBy(ref.bbox);
+            centroids.expandBy(ref.bbox.getCenter());
+        }
+        bvh.m_nodes[node_idx].bbox = bbox;
+
+        float leafCost = (float) BVHBuildTask::INTERSECTION_COST * bvh.leafCost(size);
+        float tri_factor = (float) BVHBuildTask::INTERSECTION_COST / bbox.getSurfaceArea();
+
+        Split object, spatial;
+        if (size > 1 && depth < MAX_DEPTH) {
+            object = findObjectSplit(refs, centroids, tri_factor);
+
+            /* Only try splitting space when the object split leaves overlapping children */
+            BoundingBox3f overlap = object.bboxLeft;
+            overlap.clip(object.bboxRight);
+            if (referenceCount < maxReferences && overlap.isValid() &&
+                overlap.getSurfaceArea() > minOverlap)
+                spatial = findSpatialSplit(refs, bbox, tri_factor);
+        }
+
+        std::vector<Reference> left, right;
+        if (spatial.cost < object.cost && spatial.cost < leafCost)
+            performSpatialSplit(refs, spatial, left, right);
+        else if (object.cost < leafCost)
+            performObjectSplit(refs, object, left, right);
+
+        if (left.empty() || right.empty()) {
+            /* Splitting does not reduce the cost, make a leaf */
+            BVH::BVHNode &node = bvh.m_nodes[node_idx];
+            node.leaf.flag = 1;
+            node.leaf.start = (uint32_t) bvh.m_indices.size();
+            node.leaf.size = size;
+            for (const Reference &ref : refs)
+                bvh.m_indices.push_back(ref.index);
+            return node_idx;
+        }
+
+        int axis = spatial.cost < object.cost && spatial.cost < leafCost ? spatial.axis : object.axis;
+
+        /* Release the parent's references before descending */
+        std::vector<Reference>().swap(refs);
+
+        buildNode(left, depth + 1);
+        uint32_t node_idx_right = buildNode(right, depth + 1);
+
+        BVH::BVHNode &node = bvh.m_nodes[node_idx];
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = axis;
+        node.inner.flag = 0;
+        return node_idx;
+    }
+
+    /// Binned SAH over the reference centroids along every axis
+    Split findObjectSplit(const std::vector<Reference> &refs, const BoundingBox3f &centroids,
+                          float tri_factor) const {
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centroids.min[axis], max = centroids.max[axis];
+            if (!(max > min))
+                continue;
+            float bin_size = (max - min) / BIN_COUNT, inv_bin_size = 1.f / bin_size;
+
+            uint32_t counts[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT];
+            for (const Reference &ref : refs) {
+                int index = objectBin(ref, axis, min, inv_bin_size);
+                counts[index]++;
+                bins[index].expandBy(ref.bbox);
+            }
+
+            sweep(counts, counts, bins, tri_factor, axis, min, bin_size, best);
+        }
+        return best;
+    }
+
+    /// Binned SAH over space: every reference is clipped into all bins it overlaps
+    Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox,
+                           float tri_factor) const {
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = bbox.min[axis], max = bbox.max[axis];
+            if (!(max > min))
+                continue;
+            float bin_size = (max - min) / BIN_COUNT, inv_bin_size = 1.f / bin_size;
+
+            uint32_t entries[BIN_COUNT] = { 0 }, exits[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT];
+            for (const Reference &ref : refs) {
+                int first = spatialBin(ref.bbox.min[axis], min, inv_bin_size);
+                int last = std::max(spatialBin(ref.bbox.max[axis], min, inv_bin_size), first);
+
+                Reference current = ref;
+                for (int i = first; i < last; ++i) {
+                    Reference leftRef, rightRef;
+                    splitReference(current, axis, min + (i + 1) * bin_size, leftRef, rightRef);
+                    bins[i].expandBy(leftRef.bbox);
+                    current = rightRef;
+                }
+                bins[last].expandBy(current.bbox);
+                entries[first]++;
+                exits[last]++;
+            }
+
+            sweep(entries, exits, bins, tri_factor, axis, min, bin_size, best);
+        }
+        return best;
+    }
+
+    /**
+     * Evaluate the SAH of all bin boundaries. References counted in
+     * \c leftCounts are on the left of boundaries after their bin,
+     * those counted in \c rightCounts are on the right of boundaries
+     * before their bin (the two agree for object splits).
+     */
+    void sweep(const uint32_t *leftCounts, const uint32_t *rightCounts,
+               const BoundingBox3f *bins, float tri_factor, int axis,
+               float min, float bin_size, Split &best) const {
+        BoundingBox3f bbox_right[BIN_COUNT];
+        uint32_t count_right[BIN_COUNT];
+        bbox_right[BIN_COUNT - 1] = bins[BIN_COUNT - 1];
+        count_right[BIN_COUNT - 1] = rightCounts[BIN_COUNT - 1];
+        for (int i = BIN_COUNT - 2; i >= 0; --i) {
+            bbox_right[i] = BoundingBox3f::merge(bbox_right[i + 1], bins[i]);
+            count_right[i] = count_right[i + 1] + rightCounts[i];
+        }
+
+        BoundingBox3f bbox_left;
+        uint32_t count_left = 0;
+        for (int i = 0; i < BIN_COUNT - 1; ++i) {
+            bbox_left.expandBy(bins[i]);
+            count_left += leftCounts[i];
+            uint32_t prims_right = count_right[i + 1];
+            if (count_left == 0 || prims_right == 0)
+                continue;
+
+            float sah_cost = 2.0f * BVHBuildTask::TRAVERSAL_COST +
+                tri_factor * (bvh.leafCost(count_left) * bbox_left.getSurfaceArea() +
+                              bvh.leafCost(prims_right) * bbox_right[i + 1].getSurfaceArea());
+
+            if (sah_cost < best.cost) {
+                best.cost = sah_cost;
+                best.axis = axis;
+                best.bin = i;
+                best.min = min;
+                best.binSize = bin_size;
+                best.bboxLeft = bbox_left;
+                best.bboxRight = bbox_right[i + 1];
+            }
+        }
+    }
+
+    void performObjectSplit(const std::vector<Reference> &refs, const Split &split,
+                            std::vector<Reference> &left, std::vector<Reference> &right) const {
+        float inv_bin_size = 1.f / split.binSize;
+        for (const Reference &ref : refs) {
+            if (objectBin(ref, split.axis, split.min, inv_bin_size) <= split.bin)
+                left.push_back(ref);
+            else
+                right.push_back(ref);
+        }
+    }
+
+    void performSpatialSplit(const std::vector<Reference> &refs, const Split &split,
+                             std::vector<Reference> &left, std::vector<Reference> &right) {
+        int axis = split.axis;
+        float pos = split.plane();
+
+        /* Sort out the references that lie entirely on one side first */
+        BoundingBox3f bbox_left, bbox_right;
+        std::vector<const Reference *> straddling;
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= pos) {
+                left.push_back(ref);
+                bbox_left.expandBy(ref.bbox);
+            } else if (ref.bbox.min[axis] >= pos) {
+                right.push_back(ref);
+                bbox_right.expandBy(ref.bbox);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+
+        uint32_t count_left = (uint32_t) (left.size() + straddling.size());
+        uint32_t count_right = (uint32_t) (right.size() + straddling.size());
+
+        for (const Reference *ref : straddling) {
+            Reference leftRef, rightRef;
+            splitReference(*ref, axis, pos, leftRef, rightRef);
+
+            /* Reference unsplitting: compare duplicating the reference against
+               moving it to either side as a whole */
+            BoundingBox3f split_left = BoundingBox3f::merge(bbox_left, leftRef.bbox),
+                          split_right = BoundingBox3f::merge(bbox_right, rightRef.bbox),
+                          whole_left = BoundingBox3f::merge(bbox_left, ref->bbox),
+                          whole_right = BoundingBox3f::merge(bbox_right, ref->bbox);
+
+            float cost_split = split_left.getSurfaceArea() * count_left +
+                               split_right.getSurfaceArea() * count_right;
+            float cost_left = whole_left.getSurfaceArea() * count_left +
+                              split_right.getSurfaceArea() * (count_right - 1);
+            float cost_right = split_left.getSurfaceArea() * (count_left - 1) +
+                               whole_right.getSurfaceArea() * count_right;
+
+            if (referenceCount >= maxReferences)
+                cost_split = std::numeric_limits<float>::infinity();
+
+            if (cost_left <= cost_split && cost_left <= cost_right) {
+                left.push_back(*ref);
+                bbox_left = whole_left;
+                count_right--;
+            } else if (cost_right <= cost_split) {
+                right.push_back(*ref);
+                bbox_right = whole_right;
+                count_left--;
+            } else {
+                left.push_back(leftRef);
+                right.push_back(rightRef);
+                bbox_left = split_left;
+                bbox_right = split_right;
+                referenceCount++;
+            }
+        }
+    }
+
+    /**
+     * Split a reference at the plane <tt>p[axis] == pos</tt>. Triangles
+     * are clipped exactly; other shapes fall back to splitting their box.
+     */
+    void splitReference(const Reference &ref, int axis, float pos,
+                        Reference &left, Reference &right) const {
+        left.index = right.index = ref.index;
+        left.bbox.reset();
+        right.bbox.reset();
+
+        uint32_t idx = ref.index;
+        const Mesh *mesh = meshes[bvh.findShape(idx)];
+        if (mesh) {
+            const MatrixXf &V = mesh->getVertexPositions();
+
+            Point3f v1 = V.col(mesh->getVertexIndex(2, idx));
+            for (int i = 0; i < 3; ++i) {
+                Point3f v0 = v1;
+                v1 = V.col(mesh->getVertexIndex(i, idx));
+                float v0p = v0[axis], v1p = v1[axis];
+
+                if (v0p <= pos)
+                    left.bbox.expandBy(v0);
+                if (v0p >= pos)
+                    right.bbox.expandBy(v0);
+
+                /* Edge crossing the plane */
+                if ((v0p < pos && v1p > pos) || (v0p > pos && v1p < pos)) {
+                    float t = std::min(std::max((pos - v0p) / (v1p - v0p), 0.f), 1.f);
+                    Point3f p = v0 + (v1 - v0) * t;
+                    p[axis] = pos;
+                    left.bbox.expandBy(p);
+                    right.bbox.expandBy(p);
+                }
+            }
+        } else {
+            left.bbox = right.bbox = ref.bbox;
+        }
+
+        left.bbox.max[axis] = pos;
+        right.bbox.min[axis] = pos;
+        left.bbox.clip(ref.bbox);
+        right.bbox.clip(ref.bbox);
+    }
+
+    static int objectBin(const Reference &ref, int axis, float min, float inv_bin_size) {
+        return std::min(std::max((int) ((ref.bbox.getCenter()[axis] - min) * inv_bin_size), 0),
+                        (int) BIN_COUNT - 1);
+    }
+
+    static int spatialBin(float value, float min, float inv_bin_size) {
+        return std::min(std::max((int) ((value - min) * inv_bin_size), 0), (int) BIN_COUNT - 1);
+    }
+
+private:
+    BVH &bvh;
+    float splitBudget;
+    std::vector<const Mesh *> meshes;
+    uint64_t referenceCount = 0, maxReferences = 0;
+    float minOverlap = 0.f;
+};
+
+/// Return the number of leading zero bits of a nonzero mask
+static inline int leadingZeros(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return 31 - (int) index;
+#else
+    return __builtin_clz(mask);
+#endif
 }
 
-void BVH::clear() {
-    for (auto shape : m_shapes)
-        delete shape;
-    m_shapes.clear();
-    m_shapeOffset.clear();
-    m_shapeOffset.push_back(0u);
-    m_nodes.clear();
-    m_indices.clear();
-    m_bbox.reset();
-    m_nodes.shrink_to_fit();
-    m_shapes.shrink_to_fit();
-    m_shapeOffset.shrink_to_fit();
-    m_indices.shrink_to_fit();
+/// Spread the lower 10 bits of \c v so that there are two zero bits between each of them
+static inline uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
 }
 
-void BVH::build() {
-    uint32_t size  = getPrimitiveCount();
-    if (size == 0)
-        return;
-    cout << "Constructing a SAH BVH (" << m_shapes.size()
-        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
-        << size << " primitives) .. ";
-    cout.flush();
-    Timer timer;
+/**
+ * \brief Linear BVH builder based on Morton codes
+ *
+ * Primitive centroids are quantized to a 2^10 grid per axis, and the
+ * interleaved (Morton) codes are sorted with a parallel radix sort. Nodes
+ * are then split where the highest differing code bit changes, as in
+ * "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d
+ * Trees" by Tero Karras (Proc. High Performance Graphics 2012). This
+ * is much faster than binned SAH but produces a worse tree.
+ *
+ * With SAH refinement enabled (HLBVH, see "HLBVH: Hierarchical LBVH
+ * Construction for Real-Time Ray Tracing of Dynamic Geometry" by Jacopo
+ * Pantaleoni and David Luebke, HPG 2010), primitives are first grouped
+ * into clusters sharing the top bits of their code. Each cluster gets
+ * an LBVH subtree, and the levels above them are built with a full SAH
+ * sweep over the clusters.
+ *
+ * Nodes are placed into the same conservatively allocated array as in
+ * \ref BVHBuildTask, so the usual compactification pass applies.
+ */
+class LBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Maximum number of primitives per leaf (unless the BVH asks for larger leaves)
+        LEAF_SIZE = 2,
 
-    /* Conservative estimate for the total number of nodes */
-    m_nodes.resize(2*size);
-    memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-    m_nodes[0].bbox = m_bbox;
-    m_indices.resize(size);
+        /// Build subtrees with fewer primitives serially
+        SERIAL_THRESHOLD = 4096,
 
-    if (sizeof(BVHNode) != 32)
-        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+        /// Number of Morton code bits that identify a cluster (HLBVH)
+        CLUSTER_BITS = 15,
 
-    for (uint32_t i = 0; i < size; ++i)
-        m_indices[i] = i;
-
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
-    std::pair<float, uint32_t> stats = statistics();
-
-    /* The node array was allocated conservatively and now contains
-       many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
-
-    for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode &new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t) skipped;
-
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                (skipped - skipped_accum[new_node.inner.rightChild]));
-        }
-    }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
+        /// Keys sorted per radix sort block
+        SORT_BLOCK_SIZE = 65536
+    };
 
-    m_nodes = std::move(compactified);
-}
+    LBVHBuilder(BVH &bvh, bool refineTop) : bvh(bvh), refineTop(refineTop) { }
 
-std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
-    const BVHNode &node = m_nodes[node_idx];
-    if (node.isLeaf()) {
-        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-    } else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-        float saCur = node.bbox.getSurfaceArea();
-        float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
-            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-        return std::make_pair(
-            sahCost,
-            stats_left.second + stats_right.second + 1u
+    void build() {
+        uint32_t size = bvh.getPrimitiveCount();
+
+        /* Gather primitive bounds and quantize their centroids */
+        bboxes.resize(size);
+        std::vector<Point3f> centroids(size);
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    uint32_t idx = i;
+                    const Shape *shape = bvh.m_shapes[bvh.findShape(idx)];
+                    bboxes[i] = shape->getBoundingBox(idx);
+                    centroids[i] = shape->getCentroid(idx);
+                    result.expandBy(centroids[i]);
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
         );
-    }
-}
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+        Vector3f extents = centroidBounds.getExtents();
+        Vector3f scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? 1023.f / extents[axis] : 0.f;
 
-    its.t = std::numeric_limits<float>::infinity();
+        /* Sort keys hold the code in the upper and the primitive index in the lower half */
+        std::vector<uint64_t> keys(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Vector3f p = (centroids[i] - centroidBounds.min).cwiseProduct(scale);
+                    uint32_t code = (expandBits((uint32_t) p.x()) << 2) |
+                                    (expandBits((uint32_t) p.y()) << 1) |
+                                     expandBits((uint32_t) p.z());
+                    keys[i] = ((uint64_t) code << 32) | i;
+                }
+            }
+        );
+        std::vector<Point3f>().swap(centroids);
 
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+        radixSort(keys);
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
-        return false;
+        codes.resize(size);
+        bvh.m_indices.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    codes[i] = (uint32_t) (keys[i] >> 32);
+                    bvh.m_indices[i] = (uint32_t) keys[i];
+                }
+            }
+        );
+        std::vector<uint64_t>().swap(keys);
+
+        /* Conservative estimate for the total number of nodes */
+        bvh.m_nodes.assign(2 * size, BVH::BVHNode());
+
+        if (refineTop) {
+            std::vector<Cluster> clusters;
+            uint32_t shift = 30 - CLUSTER_BITS;
+            for (uint32_t begin = 0; begin < size; ) {
+                uint32_t end = begin + 1;
+                while (end < size && (codes[end] >> shift) == (codes[begin] >> shift))
+                    ++end;
+                clusters.push_back(Cluster { begin, end, BoundingBox3f(), { } });
+                begin = end;
+            }
 
-    bool foundIntersection = false;
-    uint32_t f = 0;
+            /* Build the cluster subtrees first (into separate arrays, since
+               their final position is not known yet); their boxes drive
+               the top-level SAH */
+            tbb::parallel_for(
+                tbb::blocked_range<size_t>(0, clusters.size()),
+                [&](const tbb::blocked_range<size_t> &range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        Cluster &cluster = clusters[i];
+                        cluster.nodes.assign(2 * (cluster.end - cluster.begin), BVH::BVHNode());
+                        cluster.bbox = buildSubtree(cluster.nodes.data(), 0u, cluster.begin, cluster.end);
+                    }
+                }
+            );
+            buildTop(0u, clusters.data(), clusters.data() + clusters.size());
+        } else {
+            buildSubtree(bvh.m_nodes.data(), 0u, 0u, size);
+        }
 
-    while (true) {
-        const BVHNode &node = m_nodes[node_idx];
+        std::vector<BoundingBox3f>().swap(bboxes);
+        std::vector<uint32_t>().swap(codes);
+    }
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
+private:
+    /// Range of primitives that share the top bits of their Morton codes
+    struct Cluster {
+        uint32_t begin, end;
+        BoundingBox3f bbox;
+        std::vector<BVH::BVHNode> nodes; ///< LBVH subtree, indexed from 0
+    };
+
+    /// LBVH subtree over the sorted primitives <tt>[begin, end)</tt>
+    BoundingBox3f buildSubtree(BVH::BVHNode *nodes, uint32_t node_idx, uint32_t begin, uint32_t end) {
+        uint32_t size = end - begin;
+        BVH::BVHNode *node = &nodes[node_idx];
+
+        if (size <= std::max((uint32_t) LEAF_SIZE, bvh.getLeafSize())) {
+            BoundingBox3f bbox;
+            for (uint32_t i = begin; i < end; ++i)
+                bbox.expandBy(bboxes[bvh.m_indices[i]]);
+            node->bbox = bbox;
+            node->leaf.flag = 1;
+            node->leaf.start = begin;
+            node->leaf.size = size;
+            return bbox;
         }
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx<64);
+        int axis;
+        uint32_t split = findSplit(begin, end, axis);
+        uint32_t left_count = split - begin;
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+
+        BoundingBox3f bbox_left, bbox_right;
+        if (size > SERIAL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { bbox_left = buildSubtree(nodes, node_idx_left, begin, split); },
+                [&] { bbox_right = buildSubtree(nodes, node_idx_right, split, end); }
+            );
         } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Shape *shape = m_shapes[findShape(idx)];
-
-                float u, v, t;
-                if (shape->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = shape;
-                    f = idx;
+            bbox_left = buildSubtree(nodes, node_idx_left, begin, split);
+            bbox_right = buildSubtree(nodes, node_idx_right, split, end);
+        }
+
+        node->bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+        node->inner.rightChild = node_idx_right;
+        node->inner.axis = axis;
+        node->inner.flag = 0;
+        return node->bbox;
+    }
+
+    /**
+     * Find the first index whose code differs from \c codes[begin] in the
+     * highest bit that varies over the range; falls back to the middle if
+     * all codes are equal. Also returns the axis that bit belongs to.
+     */
+    uint32_t findSplit(uint32_t begin, uint32_t end, int &axis) const {
+        uint32_t first = codes[begin], last = codes[end - 1];
+        if (first == last) {
+            axis = 0;
+            return begin + (end - begin) / 2;
+        }
+
+        int prefix = leadingZeros(first ^ last);
+        /* Bits are interleaved as ..xyz, starting with x at bit 29 */
+        axis = (29 - (31 - prefix)) % 3;
+
+        uint32_t split = begin, step = end - 1 - begin;
+        do {
+            step = (step + 1) >> 1;
+            uint32_t candidate = split + step;
+            if (candidate < end - 1 && leadingZeros(first ^ codes[candidate]) > prefix)
+                split = candidate;
+        } while (step > 1);
+
+        return split + 1;
+    }
+
+    /**
+     * Top levels over a list of clusters, built with a full SAH sweep.
+     * Once a single cluster remains, its subtree is copied into place.
+     */
+    void buildTop(uint32_t node_idx, Cluster *begin, Cluster *end) {
+        BVH::BVHNode &node = bvh.m_nodes[node_idx];
+        size_t count = end - begin;
+
+        if (count == 1) {
+            /* A subtree over k primitives occupies at most 2k-1 slots */
+            std::vector<BVH::BVHNode> &nodes = begin->nodes;
+            for (size_t i = 0; i + 1 < nodes.size(); ++i) {
+                BVH::BVHNode &target = bvh.m_nodes[node_idx + i];
+                target = nodes[i];
+                if (!target.isUnused() && target.isInner())
+                    target.inner.rightChild += node_idx;
+            }
+            std::vector<BVH::BVHNode>().swap(nodes);
+            return;
+        }
+
+        BoundingBox3f bbox;
+        for (Cluster *c = begin; c != end; ++c)
+            bbox.expandBy(c->bbox);
+
+        /* Sweep over the clusters sorted by centroid along every axis */
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best_axis = 0;
+        size_t best_index = count / 2;
+        std::vector<float> left_areas(count);
+        for (int axis = 0; axis < 3; ++axis) {
+            std::sort(begin, end, [axis](const Cluster &c1, const Cluster &c2) {
+                return c1.bbox.getCenter()[axis] < c2.bbox.getCenter()[axis];
+            });
+
+            BoundingBox3f bbox_left;
+            uint32_t prims = 0;
+            std::vector<uint32_t> left_prims(count);
+            for (size_t i = 0; i < count; ++i) {
+                bbox_left.expandBy(begin[i].bbox);
+                prims += begin[i].end - begin[i].begin;
+                left_areas[i] = bbox_left.getSurfaceArea();
+                left_prims[i] = prims;
+            }
+
+            BoundingBox3f bbox_right;
+            for (size_t i = count - 1; i >= 1; --i) {
+                bbox_right.expandBy(begin[i].bbox);
+                float cost = left_prims[i - 1] * left_areas[i - 1] +
+                             (prims - left_prims[i - 1]) * bbox_right.getSurfaceArea();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_index = i;
                 }
             }
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
         }
-    }
 
-    if (foundIntersection) {
-        its.mesh->setHitInformation(f,ray,its);
+        std::sort(begin, end, [best_axis](const Cluster &c1, const Cluster &c2) {
+            return c1.bbox.getCenter()[best_axis] < c2.bbox.getCenter()[best_axis];
+        });
+
+        uint32_t left_count = 0;
+        for (Cluster *c = begin; c != begin + best_index; ++c)
+            left_count += c->end - c->begin;
+
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.bbox = bbox;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
+
+        buildTop(node_idx_left, begin, begin + best_index);
+        buildTop(node_idx_right, begin + best_index, end);
     }
 
-    return foundIntersection;
+    /**
+     * Stable parallel LSD radix sort of the keys by their upper 32 bits
+     * (the Morton code; only the lower 30 of them are used)
+     */
+    static void radixSort(std::vector<uint64_t> &keys) {
+        size_t size = keys.size();
+        size_t blocks = (size + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+        std::vector<uint64_t> temp(size);
+        std::vector<uint32_t> offsets(blocks * 256);
+
+        for (int shift = 32; shift < 64; shift += 8) {
+            /* Per-block digit histograms */
+            tbb::parallel_for(size_t(0), blocks, [&](size_t block) {
+                uint32_t *hist = &offsets[block * 256];
+                memset(hist, 0, sizeof(uint32_t) * 256);
+                size_t end = std::min(size, (block + 1) * SORT_BLOCK_SIZE);
+                for (size_t i = block * SORT_BLOCK_SIZE; i < end; ++i)
+                    hist[(keys[i] >> shift) & 0xFF]++;
+            });
+
+            /* Exclusive prefix sum, digit-major so that the sort stays stable */
+            uint32_t sum = 0;
+            for (int digit = 0; digit < 256; ++digit) {
+                for (size_t block = 0; block < blocks; ++block) {
+                    uint32_t count = offsets[block * 256 + digit];
+                    offsets[block * 256 + digit] = sum;
+                    sum += count;
+                }
+            }
+
+            tbb::parallel_for(size_t(0), blocks, [&](size_t block) {
+                uint32_t *offset = &offsets[block * 256];
+                size_t end = std::min(size, (block + 1) * SORT_BLOCK_SIZE);
+                for (size_t i = block * SORT_BLOCK_SIZE; i < end; ++i)
+                    temp[offset[(keys[i] >> shift) & 0xFF]++] = keys[i];
+            });
+
+            keys.swap(temp);
+        }
+    }
+
+private:
+    BVH &bvh;
+    bool refineTop;
+    std::vector<BoundingBox3f> bboxes; ///< Primitive bounds (by primitive index)
+    std::vector<uint32_t> codes;       ///< Sorted Morton codes
+};
+
+void BVH::addShape(Shape *shape) {
+    m_shapes.push_back(shape);
+    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
+    m_bbox.expandBy(shape->getBoundingBox());
+}
+
+void BVH::setWidth(uint32_t width) {
+    if (width != 2 && width != 4 && width != 8)
+        throw NoriException("BVH: unsupported branching factor %i (must be 2, 4, or 8)", width);
+    m_width = width;
+}
+
+void BVH::setTriangleWidth(uint32_t width) {
+    if (width != 1 && width != 4 && width != 8)
+        throw NoriException("BVH: unsupported triangle width %i (must be 1, 4, or 8)", width);
+    m_triangleWidth = width;
+}
+
+void BVH::setCompression(uint32_t bits) {
+    if (bits != 0 && bits != 8 && bits != 16)
+        throw NoriException("BVH: unsupported node compression %i (must be 0, 8, or 16 bits)", bits);
+    m_compression = bits;
+}
+
+void BVH::setBuilder(const std::string &name) {
+    if (name == "sah")
+        m_builder = ESAHBuilder;
+    else if (name == "sbvh")
+        m_builder = ESpatialSplitBuilder;
+    else if (name == "lbvh")
+        m_builder = ELBVHBuilder;
+    else if (name == "hlbvh")
+        m_builder = EHLBVHBuilder;
+    else
+        throw NoriException("BVH: unknown builder \"%s\" (must be \"sah\", \"sbvh\", "
+                            "\"lbvh\", or \"hlbvh\")", name);
+}
+
+void BVH::clear() {
+    for (auto shape : m_shapes)
+        delete shape;
+    m_shapes.clear();
+    m_shapeOffset.clear();
+    m_shapeOffset.push_back(0u);
+    m_bbox.reset();
+    m_shapes.shrink_to_fit();
+    m_shapeOffset.shrink_to_fit();
+    clearHierarchy();
+}
+
+void BVH::clearHierarchy() {
+    m_nodes.clear();
+    m_indices.clear();
+    m_primitives.clear();
+    m_triangles.clear();
+    m_triangleShapes.clear();
+    m_blocks4.clear();
+    m_blocks8.clear();
+    m_leafBlocks.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_nodes4q8.clear();
+    m_nodes4q16.clear();
+    m_nodes8q8.clear();
+    m_nodes8q16.clear();
+    m_nodes.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_nodes4q8.shrink_to_fit();
+    m_nodes4q16.shrink_to_fit();
+    m_nodes8q8.shrink_to_fit();
+    m_nodes8q16.shrink_to_fit();
+    m_indices.shrink_to_fit();
+    m_primitives.shrink_to_fit();
+    m_triangles.shrink_to_fit();
+    m_triangleShapes.shrink_to_fit();
+    m_blocks4.shrink_to_fit();
+    m_blocks8.shrink_to_fit();
+    m_leafBlocks.shrink_to_fit();
+}
+
+float BVH::construct() {
+    uint32_t size  = getPrimitiveCount();
+    static const char *builderNames[] = { "SAH BVH", "spatial split BVH", "Morton code LBVH", "Morton code HLBVH" };
+    log() << "Constructing a " << builderNames[m_builder]
+        << " (" << m_shapes.size()
+        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+        << size << " primitives) .. ";
+    log().flush();
+    Timer timer;
+
+    std::pair<float, uint32_t> stats;
+    size_t buildMemory;
+    uint64_t duplicates = 0;
+
+    if (m_builder == ESpatialSplitBuilder) {
+        SBVHBuilder builder(*this, m_splitBudget);
+        builder.build();
+        stats = statistics();
+        buildMemory = sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size();
+        duplicates = builder.getDuplicateCount();
+    } else if (m_builder == ELBVHBuilder || m_builder == EHLBVHBuilder) {
+        LBVHBuilder builder(*this, m_builder == EHLBVHBuilder);
+        builder.build();
+        stats = statistics();
+        buildMemory = sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size();
+    } else {
+        /* Conservative estimate for the total number of nodes */
+        m_nodes.assign(2*size, BVHNode());
+        m_nodes[0].bbox = m_bbox;
+        m_indices.resize(size);
+
+        for (uint32_t i = 0; i < size; ++i)
+            m_indices[i] = i;
+
+        uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
+        BVHBuildTask& task = *new(tbb::task::allocate_root())
+            BVHBuildTask(*this, 0u, indices, indices + size , temp);
+        tbb::task::spawn_root_and_wait(task);
+        delete[] temp;
+        stats = statistics();
+        buildMemory = sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size();
+    }
+
+    if (m_nodes.size() != stats.second) {
+        /* The node array was allocated conservatively and now contains
+           many unused entries -- do a compactification pass. Right children
+           always come later in the array, so walking backwards lets every
+           copied pool entry remember its new index in place (instead of
+           keeping a separate table as large as the pool). */
+        std::vector<BVHNode> compactified(stats.second);
+
+        for (int64_t i = stats.second-1, j = m_nodes.size(); i >= 0; --i) {
+            while (m_nodes[--j].isUnused())
+                ;
+            BVHNode &new_node = compactified[i];
+            new_node = m_nodes[j];
+
+            if (new_node.isInner())
+                new_node.inner.rightChild = m_nodes[new_node.inner.rightChild].leaf.start;
+            m_nodes[j].leaf.start = (uint32_t) i;
+        }
+
+        m_nodes = std::move(compactified);
+    }
+
+    log() << "done (took " << timer.elapsedString() << " and "
+        << memString(buildMemory + sizeof(PrimitiveRef) * m_indices.size())
+        << ", SAH cost = " << stats.first;
+    if (duplicates > 0)
+        log() << ", " << duplicates << " duplicated references";
+    log() << ")." << endl;
+
+    return stats.first;
+}
+
+void BVH::build() {
+    if (getPrimitiveCount() == 0)
+        return;
+
+    if (sizeof(BVHNode) != 32)
+        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+
+    if (m_compression != 0 && m_width == 2)
+        throw NoriException("BVH: node compression requires a width of 4 or 8");
+
+    if (m_treeletSize != 0 && m_width == 2)
+        throw NoriException("BVH: the treelet layout requires a width of 4 or 8");
+
+    /* Look for a previously built hierarchy of the same geometry */
+    std::string cacheFile;
+    uint64_t key = 0;
+    bool cached = false;
+    if (!m_cacheDirectory.empty()) {
+        Timer timer;
+        key = cacheKey();
+
+        filesystem::path directory(m_cacheDirectory);
+        if (!directory.exists())
+            filesystem::create_directory(directory);
+        std::ostringstream name;
+        name << "bvh-" << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+        cacheFile = (directory / filesystem::path(name.str())).str();
+
+        float sahCost;
+        cached = loadCache(cacheFile, key, sahCost);
+        if (cached)
+            log() << "BVH cache hit: loaded \"" << cacheFile << "\" (took "
+                << timer.elapsedString() << ", " << m_nodes.size()
+                << " nodes, SAH cost = " << sahCost << ")." << endl;
+        else
+            log() << "BVH cache miss: no entry \"" << cacheFile << "\" (lookup took "
+                << timer.elapsedString() << "), rebuilding." << endl;
+    }
+
+    if (!cached) {
+        float sahCost = construct();
+
+        if (!cacheFile.empty()) {
+            log() << "Writing BVH cache .. ";
+            log().flush();
+            Timer timer;
+            saveCache(cacheFile, key, sahCost);
+            log() << "done (took " << timer.elapsedString() << ")." << endl;
+        }
+    }
+
+    /* Resolve the owning shape of every leaf entry once, so that
+       traversal does not have to search m_shapeOffset */
+    uint32_t refCount = (uint32_t) m_indices.size();
+    m_primitives.resize(refCount);
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, refCount, BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t idx = m_indices[i];
+                uint32_t shapeIdx = findShape(idx);
+                m_primitives[i] = PrimitiveRef { shapeIdx, idx };
+            }
+        }
+    );
+
+    if (m_precomputeTriangles || m_triangleWidth > 1)
+        precomputeTriangles();
+
+    if (m_width > 2) {
+        log() << "Collapsing into a BVH" << m_width << " .. ";
+        log().flush();
+        Timer timer;
+        size_t wideSize;
+        if (m_width == 4) {
+            collapse(m_nodes4, 0u);
+            wideSize = m_nodes4.size();
+        } else {
+            collapse(m_nodes8, 0u);
+            wideSize = m_nodes8.size();
+        }
+        size_t nodeSize = m_width == 4 ? sizeof(BVHWideNode<4>) : sizeof(BVHWideNode<8>);
+        log() << "done (took " << timer.elapsedString() << ", "
+            << wideSize << " nodes, " << memString(nodeSize * wideSize)
+            << ")." << endl;
+
+        if (m_treeletSize != 0) {
+            log() << "Reordering BVH" << m_width << " nodes into "
+                << memString(m_treeletSize) << " treelets .. ";
+            log().flush();
+            timer.reset();
+            if (m_width == 4)
+                reorderTreelets(m_nodes4);
+            else
+                reorderTreelets(m_nodes8);
+            log() << "done (took " << timer.elapsedString() << ")." << endl;
+        }
+    }
+
+    if (m_compression != 0) {
+        log() << "Quantizing BVH" << m_width << " nodes to " << m_compression << " bits .. ";
+        log().flush();
+        Timer timer;
+        size_t binary = sizeof(BVHNode) * m_nodes.size(), before, after;
+        if (m_width == 4) {
+            before = sizeof(BVHWideNode<4>) * m_nodes4.size();
+            if (m_compression == 8) {
+                quantize(m_nodes4, m_nodes4q8);
+                after = sizeof(BVHQuantizedNode<4, uint8_t>) * m_nodes4q8.size();
+            } else {
+                quantize(m_nodes4, m_nodes4q16);
+                after = sizeof(BVHQuantizedNode<4, uint16_t>) * m_nodes4q16.size();
+            }
+        } else {
+            before = sizeof(BVHWideNode<8>) * m_nodes8.size();
+            if (m_compression == 8) {
+                quantize(m_nodes8, m_nodes8q8);
+                after = sizeof(BVHQuantizedNode<8, uint8_t>) * m_nodes8q8.size();
+            } else {
+                quantize(m_nodes8, m_nodes8q16);
+                after = sizeof(BVHQuantizedNode<8, uint16_t>) * m_nodes8q16.size();
+            }
+        }
+
+        /* Traversal only needs the quantized nodes from now on */
+        m_nodes.clear();
+        m_nodes4.clear();
+        m_nodes8.clear();
+        m_nodes.shrink_to_fit();
+        m_nodes4.shrink_to_fit();
+        m_nodes8.shrink_to_fit();
+
+        log() << "done (took " << timer.elapsedString() << ", "
+            << memString(before) << " -> " << memString(after)
+            << ", released " << memString(binary) << " of binary nodes)." << endl;
+    }
+}
+
+void BVH::refit() {
+    if (m_primitives.empty())
+        return;
+
+    if (m_nodes.empty()) {
+        /* The binary nodes were released after quantization */
+        rebuild();
+        return;
+    }
+
+    log() << "Refitting BVH (" << m_nodes.size() << " nodes) .. ";
+    log().flush();
+    Timer timer;
+
+    /* Leaves first. Spatial split leaves get the full primitive bounds
+       back, which is conservative. */
+    uint32_t nodeCount = (uint32_t) m_nodes.size();
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, nodeCount, BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                BVHNode &node = m_nodes[i];
+                if (!node.isLeaf())
+                    continue;
+                node.bbox.reset();
+                for (uint32_t j = node.start(); j < node.end(); ++j) {
+                    const PrimitiveRef &ref = m_primitives[j];
+                    node.bbox.expandBy(m_shapes[ref.shape]->getBoundingBox(ref.index));
+                }
+            }
+        }
+    );
+
+    /* Children are always stored after their parent, so a backwards
+       sweep sees them before it gets to the parent */
+    for (int64_t i = (int64_t) nodeCount - 1; i >= 0; --i) {
+        BVHNode &node = m_nodes[i];
+        if (node.isInner())
+            node.bbox = BoundingBox3f::merge(m_nodes[i + 1].bbox, m_nodes[node.inner.rightChild].bbox);
+    }
+
+    /* Bounds of the primitives rather than of the shapes: a mesh that
+       a shared BVH was built over may not track its changed geometry */
+    m_bbox = m_nodes[0].bbox;
+
+    if (m_width == 4) {
+        m_nodes4.clear();
+        collapse(m_nodes4, 0u);
+        if (m_treeletSize != 0)
+            reorderTreelets(m_nodes4);
+    } else if (m_width == 8) {
+        m_nodes8.clear();
+        collapse(m_nodes8, 0u);
+        if (m_treeletSize != 0)
+            reorderTreelets(m_nodes8);
+    }
+
+    log() << "done (took " << timer.elapsedString() << ")." << endl;
+
+    if (m_precomputeTriangles || m_triangleWidth > 1)
+        precomputeTriangles();
+}
+
+void BVH::rebuild() {
+    clearHierarchy();
+    m_bbox.reset();
+    for (const Shape *shape : m_shapes)
+        m_bbox.expandBy(shape->getBoundingBox());
+    build();
+}
+
+/* Layout of the BVH cache files: header, nodes, indices */
+struct BVHCacheHeader {
+    char magic[8];        ///< "NORIBVH"
+    uint32_t version;     ///< Bumped whenever the builders or the node layout change
+    uint32_t nodeSize;    ///< sizeof(BVHNode)
+    uint64_t key;         ///< Hash of the geometry and build parameters
+    uint64_t nodeCount;
+    uint64_t indexCount;
+    float sahCost;
+    uint32_t padding;
+};
+
+static const char BVH_CACHE_MAGIC[8] = "NORIBVH";
+static const uint32_t BVH_CACHE_VERSION = 1;
+
+uint64_t BVH::cacheKey() const {
+    uint64_t hash = hashValue(BVH_CACHE_VERSION);
+    hash = hashValue((uint32_t) sizeof(BVHNode), hash);
+    hash = hashValue((uint32_t) m_builder, hash);
+    hash = hashValue(getLeafSize(), hash);
+    if (m_builder == ESpatialSplitBuilder)
+        hash = hashValue(m_splitBudget, hash);
+    hash = hashValue((uint64_t) m_shapes.size(), hash);
+
+    for (const Shape *shape : m_shapes) {
+        uint32_t count = shape->getPrimitiveCount();
+        hash = hashValue(count, hash);
+
+        if (const Mesh *mesh = dynamic_cast<const Mesh *>(shape)) {
+            /* The builders only look at triangle vertices */
+            const Mesh::Geometry &geometry = *mesh->getGeometry();
+            hash = hashBytes(geometry.V.data(), sizeof(float) * geometry.V.size(), hash);
+            hash = hashBytes(geometry.F.data(), sizeof(uint32_t) * geometry.F.size(), hash);
+            hash = hashBytes(geometry.F16.data(), sizeof(uint16_t) * geometry.F16.size(), hash);
+        } else {
+            /* Other shapes only enter the build through their bounds and centroids */
+            for (uint32_t i = 0; i < count; ++i) {
+                BoundingBox3f bbox = shape->getBoundingBox(i);
+                Point3f centroid = shape->getCentroid(i);
+                hash = hashBytes(bbox.min.data(), sizeof(float) * 3, hash);
+                hash = hashBytes(bbox.max.data(), sizeof(float) * 3, hash);
+                hash = hashBytes(centroid.data(), sizeof(float) * 3, hash);
+            }
+        }
+    }
+    return hash;
+}
+
+bool BVH::loadCache(const std::string &filename, uint64_t key, float &sahCost) {
+    if (!filesystem::path(filename).is_file())
+        return false;
+
+    try {
+        MemoryMappedFile file(filename);
+        if (file.size() < sizeof(BVHCacheHeader))
+            return false;
+
+        BVHCacheHeader header;
+        memcpy(&header, file.data(), sizeof(BVHCacheHeader));
+        if (memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != BVH_CACHE_VERSION || header.nodeSize != sizeof(BVHNode) ||
+            header.key != key || header.nodeCount == 0)
+            return false;
+
+        size_t expected = sizeof(BVHCacheHeader) + header.nodeCount * sizeof(BVHNode)
+                        + header.indexCount * sizeof(uint32_t);
+        if (file.size() != expected)
+            return false;
+
+        const uint8_t *ptr = file.data() + sizeof(BVHCacheHeader);
+        m_nodes.resize(header.nodeCount);
+        /* The nodes are plain data (a packed word and a box of six floats)
+           that saveCache() wrote out byte for byte */
+        memcpy((void *) m_nodes.data(), ptr, header.nodeCount * sizeof(BVHNode));
+        ptr += header.nodeCount * sizeof(BVHNode);
+        m_indices.resize(header.indexCount);
+        memcpy(m_indices.data(), ptr, header.indexCount * sizeof(uint32_t));
+        sahCost = header.sahCost;
+    } catch (const NoriException &e) {
+        cerr << "Warning: could not read BVH cache: " << e.what() << endl;
+        m_nodes.clear();
+        m_indices.clear();
+        return false;
+    }
+    return true;
+}
+
+void BVH::saveCache(const std::string &filename, uint64_t key, float sahCost) const {
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(BVHCacheHeader));
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.nodeSize = sizeof(BVHNode);
+    header.key = key;
+    header.nodeCount = m_nodes.size();
+    header.indexCount = m_indices.size();
+    header.sahCost = sahCost;
+
+    /* Write to a temporary file first, so that concurrent renders
+       never map a partially written cache entry */
+    std::ostringstream tempName;
+    tempName << filename << "." << std::hex << (uintptr_t) this << ".tmp";
+    {
+        std::ofstream os(tempName.str(), std::ios::binary);
+        os.write((const char *) &header, sizeof(BVHCacheHeader));
+        os.write((const char *) m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+        os.write((const char *) m_indices.data(), sizeof(uint32_t) * m_indices.size());
+        if (!os) {
+            cerr << "Warning: could not write BVH cache \"" << tempName.str() << "\"" << endl;
+            std::remove(tempName.str().c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tempName.str().c_str(), filename.c_str()) != 0) {
+        /* Windows does not replace existing files */
+        std::remove(filename.c_str());
+        if (std::rename(tempName.str().c_str(), filename.c_str()) != 0) {
+            cerr << "Warning: could not write BVH cache \"" << filename << "\"" << endl;
+            std::remove(tempName.str().c_str());
+        }
+    }
+}
+
+void BVH::precomputeTriangles() {
+    m_triangleShapes.resize(m_shapes.size());
+    bool anyMesh = false;
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        m_triangleShapes[i] = dynamic_cast<const Mesh *>(m_shapes[i]) != nullptr;
+        anyMesh |= m_triangleShapes[i] != 0;
+    }
+    if (!anyMesh)
+        return;
+
+    log() << "Precomputing triangle data .. ";
+    log().flush();
+    Timer timer;
+
+    if (m_triangleWidth > 1) {
+        size_t memory, lanes;
+        if (m_triangleWidth == 4) {
+            buildTriangleBlocks(m_blocks4);
+            memory = sizeof(TriangleBlock<4>) * m_blocks4.size();
+            lanes = 4 * m_blocks4.size();
+        } else {
+            buildTriangleBlocks(m_blocks8);
+            memory = sizeof(TriangleBlock<8>) * m_blocks8.size();
+            lanes = 8 * m_blocks8.size();
+        }
+        size_t triangles = 0;
+        for (const PrimitiveRef &prim : m_primitives)
+            triangles += m_triangleShapes[prim.shape];
+        log() << "done (took " << timer.elapsedString() << " and "
+            << memString(memory + sizeof(LeafBlocks) * m_leafBlocks.size())
+            << ", " << m_triangleWidth << "-wide blocks with "
+            << tfm::format("%.1f%%", 100.0 * triangles / std::max(lanes, (size_t) 1))
+            << " of the lanes used)." << endl;
+        return;
+    }
+
+    uint32_t size = (uint32_t) m_primitives.size();
+    m_triangles.resize(size);
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                const PrimitiveRef &prim = m_primitives[i];
+                if (!m_triangleShapes[prim.shape])
+                    continue;
+                const Mesh *mesh = static_cast<const Mesh *>(m_shapes[prim.shape]);
+                const MatrixXf &V = mesh->getVertexPositions();
+                const Point3f p0 = V.col(mesh->getVertexIndex(0, prim.index)),
+                              p1 = V.col(mesh->getVertexIndex(1, prim.index)),
+                              p2 = V.col(mesh->getVertexIndex(2, prim.index));
+                PrecomputedTriangle &tri = m_triangles[i];
+                tri.p0 = p0;
+                tri.edge1 = p1 - p0;
+                tri.edge2 = p2 - p0;
+            }
+        }
+    );
+
+    log() << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(PrecomputedTriangle) * m_triangles.size())
+        << ")." << endl;
+}
+
+template <int N> void BVH::buildTriangleBlocks(std::vector<TriangleBlock<N>> &blocks) {
+    /* Give the mesh triangles of every leaf a contiguous range of blocks */
+    std::vector<uint32_t> leaves;
+    uint32_t blockCount = 0;
+    m_leafBlocks.assign(m_primitives.size(), LeafBlocks { 0u, 0u, 0u });
+    for (uint32_t i = 0; i < (uint32_t) m_nodes.size(); ++i) {
+        const BVHNode &node = m_nodes[i];
+        if (!node.isLeaf() || node.leaf.size == 0)
+            continue;
+        uint32_t triangles = 0;
+        for (uint32_t j = node.start(); j < node.end(); ++j)
+            triangles += m_triangleShapes[m_primitives[j].shape];
+        LeafBlocks &leaf = m_leafBlocks[node.start()];
+        leaf.first = blockCount;
+        leaf.count = (triangles + N - 1) / N;
+        leaf.others = node.leaf.size - triangles;
+        blockCount += leaf.count;
+        leaves.push_back(i);
+    }
+
+    blocks.resize(blockCount);
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0u, leaves.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                const BVHNode &node = m_nodes[leaves[i]];
+                const LeafBlocks &leaf = m_leafBlocks[node.start()];
+                uint32_t lane = 0;
+                for (uint32_t j = node.start(); j < node.end(); ++j) {
+                    const PrimitiveRef &prim = m_primitives[j];
+                    if (!m_triangleShapes[prim.shape])
+                        continue;
+                    const Mesh *mesh = static_cast<const Mesh *>(m_shapes[prim.shape]);
+                    const MatrixXf &V = mesh->getVertexPositions();
+                    TriangleBlock<N> &block = blocks[leaf.first + lane / N];
+                    for (int vertex = 0; vertex < 3; ++vertex)
+                        for (int axis = 0; axis < 3; ++axis)
+                            block.p[vertex][axis][lane % N] = V(axis, mesh->getVertexIndex(vertex, prim.index));
+                    block.prim[lane % N] = j;
+                    ++lane;
+                }
+
+                /* Pad the last block */
+                for (; lane < leaf.count * N; ++lane) {
+                    TriangleBlock<N> &block = blocks[leaf.first + lane / N];
+                    for (int vertex = 0; vertex < 3; ++vertex)
+                        for (int axis = 0; axis < 3; ++axis)
+                            block.p[vertex][axis][lane % N] = std::numeric_limits<float>::quiet_NaN();
+                    block.prim[lane % N] = 0;
+                }
+            }
+        }
+    );
+}
+
+template <int N> uint32_t BVH::collapse(std::vector<BVHWideNode<N>> &nodes,
+                                        uint32_t node_idx) const {
+    uint32_t wide_idx = (uint32_t) nodes.size();
+    nodes.emplace_back();
+
+    /* Gather up to N children by repeatedly opening up the
+       inner child with the largest surface area */
+    uint32_t children[N];
+    int count = 0;
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        children[count++] = node_idx;
+    } else {
+        children[count++] = node_idx + 1;
+        children[count++] = node.inner.rightChild;
+    }
+
+    while (count < N) {
+        int best = -1;
+        float best_area = -1.f;
+        for (int i = 0; i < count; ++i) {
+            const BVHNode &child = m_nodes[children[i]];
+            if (child.isInner() && child.bbox.getSurfaceArea() > best_area) {
+                best = i;
+                best_area = child.bbox.getSurfaceArea();
+            }
+        }
+        if (best == -1)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[count++] = m_nodes[opened].inner.rightChild;
+    }
+
+    BVHWideNode<N> result;
+    for (int i = 0; i < N; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            result.bounds[axis][i] = std::numeric_limits<float>::infinity();
+            result.bounds[axis + 3][i] = -std::numeric_limits<float>::infinity();
+        }
+        result.child[i] = result.count[i] = 0;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const BVHNode &child = m_nodes[children[i]];
+        for (int axis = 0; axis < 3; ++axis) {
+            result.bounds[axis][i] = child.bbox.min[axis];
+            result.bounds[axis + 3][i] = child.bbox.max[axis];
+        }
+        if (child.isLeaf()) {
+            result.child[i] = child.start();
+            result.count[i] = child.leaf.size;
+        } else {
+            result.child[i] = collapse(nodes, children[i]);
+        }
+    }
+
+    nodes[wide_idx] = result;
+    return wide_idx;
+}
+
+template <int N> void BVH::reorderTreelets(std::vector<BVHWideNode<N>> &nodes) const {
+    typedef std::pair<float, uint32_t> Candidate; ///< Surface area and index of a node
+    const uint32_t capacity = std::max((uint32_t) (m_treeletSize / sizeof(BVHWideNode<N>)), 1u);
+
+    /* Old index of every node in the new order */
+    std::vector<uint32_t> order;
+    order.reserve(nodes.size());
+
+    /* Treelet roots that still need to be laid out. This is a stack, so
+       that child treelets are placed right after their parent. */
+    std::vector<uint32_t> roots(1, 0u);
+    std::vector<Candidate> frontier;
+
+    while (!roots.empty()) {
+        frontier.assign(1, Candidate(std::numeric_limits<float>::infinity(), roots.back()));
+        roots.pop_back();
+
+        /* Grow the treelet by the children that are most likely to be visited */
+        for (uint32_t size = 0; size < capacity && !frontier.empty(); ++size) {
+            std::pop_heap(frontier.begin(), frontier.end());
+            uint32_t idx = frontier.back().second;
+            frontier.pop_back();
+            order.push_back(idx);
+
+            const BVHWideNode<N> &node = nodes[idx];
+            for (int i = 0; i < N; ++i) {
+                /* Skip leaves and unused slots (which have inverted bounds) */
+                if (node.count[i] != 0 || !(node.bounds[0][i] <= node.bounds[3][i]))
+                    continue;
+                float dx = node.bounds[3][i] - node.bounds[0][i],
+                      dy = node.bounds[4][i] - node.bounds[1][i],
+                      dz = node.bounds[5][i] - node.bounds[2][i];
+                frontier.push_back(Candidate(dx * dy + dy * dz + dz * dx, node.child[i]));
+                std::push_heap(frontier.begin(), frontier.end());
+            }
+        }
+
+        /* The rest start treelets of their own, the largest one first */
+        std::sort(frontier.begin(), frontier.end());
+        for (const Candidate &candidate : frontier)
+            roots.push_back(candidate.second);
+    }
+    assert(order.size() == nodes.size() && order[0] == 0);
+
+    std::vector<uint32_t> newIndex(nodes.size());
+    for (uint32_t i = 0; i < (uint32_t) order.size(); ++i)
+        newIndex[order[i]] = i;
+
+    std::vector<BVHWideNode<N>> result(nodes.size());
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, (uint32_t) nodes.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                BVHWideNode<N> &node = result[i];
+                node = nodes[order[i]];
+                for (int j = 0; j < N; ++j) {
+                    if (node.count[j] == 0 && node.bounds[0][j] <= node.bounds[3][j])
+                        node.child[j] = newIndex[node.child[j]];
+                }
+            }
+        }
+    );
+    nodes = std::move(result);
+}
+
+template <int N, typename Q> void BVH::quantize(const std::vector<BVHWideNode<N>> &nodes,
+                                               std::vector<BVHQuantizedNode<N, Q>> &result) const {
+    const uint32_t qmax = std::numeric_limits<Q>::max();
+    const float inf = std::numeric_limits<float>::infinity();
+    result.resize(nodes.size());
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0u, nodes.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t n = range.begin(); n != range.end(); ++n) {
+                const BVHWideNode<N> &node = nodes[n];
+                BVHQuantizedNode<N, Q> &qnode = result[n];
+
+                /* Unused slots have inverted (infinite) bounds */
+                qnode.valid = 0;
+                for (int i = 0; i < N; ++i) {
+                    if (node.bounds[0][i] <= node.bounds[3][i])
+                        qnode.valid |= 1u << i;
+                    qnode.child[i] = node.child[i];
+                    qnode.count[i] = node.count[i];
+                }
+
+                for (int axis = 0; axis < 3; ++axis) {
+                    float pmin = inf, pmax = -inf;
+                    for (int i = 0; i < N; ++i) {
+                        if (!(qnode.valid & (1u << i)))
+                            continue;
+                        pmin = std::min(pmin, node.bounds[axis][i]);
+                        pmax = std::max(pmax, node.bounds[axis + 3][i]);
+                    }
+                    if (qnode.valid == 0)
+                        pmin = pmax = 0.f;
+
+                    /* The largest step must decode to (slightly beyond) the parent maximum.
+                       Dividing the extended range in double precision and rounding up
+                       leaves at most a few ulps to fix, which also covers flat axes
+                       (pmin == pmax) that would otherwise start from a zero scale */
+                    float origin = pmin, target = std::nextafter(pmax, inf);
+                    float scale = std::nextafter(
+                        (float) (((double) target - (double) pmin) / qmax), inf);
+                    for (int step = 0; step < 8 && origin + qmax * scale < target; ++step)
+                        scale = std::nextafter(scale, inf);
+                    if (origin + qmax * scale < target)
+                        throw NoriException("BVH::quantize(): could not find a scale for [%f, %f]",
+                                            pmin, pmax);
+                    qnode.origin[axis] = origin;
+                    qnode.scale[axis] = scale;
+
+                    auto decode = [&](uint32_t q) { return origin + q * scale; };
+
+                    for (int i = 0; i < N; ++i) {
+                        uint32_t qlo = 0, qhi = 0;
+                        if ((qnode.valid & (1u << i)) && scale > 0) {
+                            /* Round outwards; keep a one ulp margin in case the
+                               decoding arithmetic is contracted differently */
+                            float lo = std::nextafter(node.bounds[axis][i], -inf);
+                            float hi = std::nextafter(node.bounds[axis + 3][i], inf);
+                            qlo = (uint32_t) std::min((float) qmax, std::max(0.f,
+                                std::floor((lo - origin) / scale)));
+                            qhi = (uint32_t) std::min((float) qmax, std::max(0.f,
+                                std::ceil((hi - origin) / scale)));
+                            while (qlo > 0 && decode(qlo) > lo)
+                                --qlo;
+                            while (qhi < qmax && decode(qhi) < hi)
+                                ++qhi;
+                        }
+                        qnode.bounds[axis][i] = (Q) qlo;
+                        qnode.bounds[axis + 3][i] = (Q) qhi;
+                    }
+                }
+            }
+        }
+    );
+}
+
+template <typename Func> bool BVH::visitWideNodes(const Func &func) const {
+    if (m_width == 4) {
+        if (m_compression == 8)
+            return func(m_nodes4q8);
+        else if (m_compression == 16)
+            return func(m_nodes4q16);
+        return func(m_nodes4);
+    } else {
+        if (m_compression == 8)
+            return func(m_nodes8q8);
+        else if (m_compression == 16)
+            return func(m_nodes8q16);
+        return func(m_nodes8);
+    }
+}
+
+std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * leafCost(node.leaf.size), 1u);
+    } else {
+        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
+        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
+        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+        float saCur = node.bbox.getSurfaceArea();
+        float sahCost =
+            2 * BVHBuildTask::TRAVERSAL_COST +
+            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+        return std::make_pair(
+            sahCost,
+            stats_left.second + stats_right.second + 1u
+        );
+    }
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+    its.t = std::numeric_limits<float>::infinity();
+
+    if (shadowRay)
+        return occluded(ray);
+
+    uint32_t f = 0;
+    bool foundIntersection = rayIntersectDeferred(ray, its, f);
+
+    if (foundIntersection) {
+        its.mesh->setHitInformation(f,ray,its);
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::rayIntersectDeferred(const Ray3f &_ray, Intersection &its, uint32_t &index) const {
+    its.t = std::numeric_limits<float>::infinity();
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_primitives.empty() || ray.maxt < ray.mint)
+        return false;
+
+    if (m_width > 2)
+        return visitWideNodes([&](const auto &nodes) {
+            return rayIntersectWide(nodes, ray, its, index);
+        });
+    else
+        return rayIntersectBinary(ray, its, index);
+}
+
+bool BVH::occluded(const Ray3f &_ray) const {
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_primitives.empty() || ray.maxt < ray.mint)
+        return false;
+
+    if (m_width > 2)
+        return visitWideNodes([&](const auto &nodes) {
+            return occludedWide(nodes, ray);
+        });
+    else
+        return occludedBinary(ray);
+}
+
+void BVH::rayIntersect(const Ray3f *rays, Intersection *its, bool *hit,
+                       uint32_t count, bool shadowRay) const {
+    for (uint32_t i = 0; i < count; i += PACKET_SIZE)
+        rayIntersectPacket(rays + i, its ? its + i : nullptr, hit + i,
+                           std::min(count - i, PACKET_SIZE), shadowRay);
+}
+
+void BVH::rayIntersectPacket(const Ray3f *rays, Intersection *its, bool *hit,
+                             uint32_t count, bool shadowRay) const {
+    if (m_nodes.empty() || m_width > 2) {
+        /* The binary tree was released after quantization, or the wide
+           nodes are used for traversal: their single-ray kernels (SIMD box
+           tests, distance culling, treelets, triangle blocks) beat testing
+           every ray of the packet against each binary node */
+        Intersection scratch;
+        for (uint32_t k = 0; k < count; ++k)
+            hit[k] = rayIntersect(rays[k], its ? its[k] : scratch, shadowRay);
+        return;
+    }
+
+    Ray3f ray[PACKET_SIZE];
+    Intersection scratch[PACKET_SIZE];
+    uint32_t f[PACKET_SIZE];
+    uint32_t active = 0, done = 0, activeCount = 0;
+
+    if (!its)
+        its = scratch;
+
+    for (uint32_t k = 0; k < count; ++k) {
+        its[k].t = std::numeric_limits<float>::infinity();
+        hit[k] = false;
+
+        /* Use an adaptive ray epsilon */
+        ray[k] = rays[k];
+        if (ray[k].mint == Epsilon)
+            ray[k].mint = std::max(ray[k].mint, ray[k].mint * ray[k].o.array().abs().maxCoeff());
+
+        if (!(ray[k].maxt < ray[k].mint)) {
+            active |= 1u << k;
+            activeCount++;
+        }
+    }
+
+    if (!active)
+        return;
+
+    TraversalCounters counters(activeCount);
+
+    /* Each stack entry remembers which rays entered the parent node */
+    struct StackEntry {
+        uint32_t node, mask;
+    };
+    StackEntry stack[64];
+    uint32_t stack_idx = 0, node_idx = 0, mask = active;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+
+        /* Test the node once against all rays that are still interested in it */
+        uint32_t hitMask = 0;
+        for (uint32_t m = mask & ~done; m; m &= m - 1) {
+            int k = lowestBit(m);
+            counters.node();
+            if (node.bbox.rayIntersect(ray[k]))
+                hitMask |= 1u << k;
+        }
+
+        if (hitMask) {
+            if (node.isInner()) {
+                /* Visit the child that is closer for the first active ray first */
+                uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+                if (ray[lowestBit(hitMask)].d[node.inner.axis] < 0)
+                    std::swap(near_idx, far_idx);
+                stack[stack_idx++] = StackEntry { far_idx, hitMask };
+                assert(stack_idx < 64);
+                node_idx = near_idx;
+                mask = hitMask;
+                continue;
+            }
+
+            for (uint32_t m = hitMask; m; m &= m - 1) {
+                int k = lowestBit(m);
+                counters.leaf(node.end() - node.start());
+                if (shadowRay) {
+                    if (occludedLeaf(node.start(), node.end(), ray[k])) {
+                        hit[k] = true;
+                        done |= 1u << k;
+                    }
+                } else if (intersectLeaf(node.start(), node.end(), ray[k], its[k], f[k])) {
+                    hit[k] = true;
+                }
+            }
+
+            /* Every shadow ray is blocked -- nothing left to do */
+            if (shadowRay && done == active)
+                break;
+        }
+
+        if (stack_idx == 0)
+            break;
+        --stack_idx;
+        node_idx = stack[stack_idx].node;
+        mask = stack[stack_idx].mask;
+    }
+
+    if (!shadowRay) {
+        for (uint32_t k = 0; k < count; ++k) {
+            if (hit[k])
+                its[k].mesh->setHitInformation(f[k], ray[k], its[k]);
+        }
+    }
+}
+
+/*
+ * Groups of 1, 4 (SSE) or 8 (AVX) float lanes, so that the triangle
+ * kernel below only has to be written once. Comparisons return a bit
+ * mask with one bit per lane.
+ */
+struct Lanes1 {
+    static const int Size = 1;
+    float v;
+
+    static Lanes1 load(const float *ptr) { return Lanes1 { *ptr }; }
+    static Lanes1 set(float value) { return Lanes1 { value }; }
+    void store(float *ptr) const { *ptr = v; }
+
+    Lanes1 operator+(Lanes1 b) const { return Lanes1 { v + b.v }; }
+    Lanes1 operator-(Lanes1 b) const { return Lanes1 { v - b.v }; }
+    Lanes1 operator*(Lanes1 b) const { return Lanes1 { v * b.v }; }
+    Lanes1 operator/(Lanes1 b) const { return Lanes1 { v / b.v }; }
+
+    /// Flip the sign wherever \c b is negative
+    Lanes1 mulsign(Lanes1 b) const { return Lanes1 { std::signbit(b.v) ? -v : v }; }
+    Lanes1 abs() const { return Lanes1 { std::abs(v) }; }
+
+    uint32_t operator>=(Lanes1 b) const { return v >= b.v ? 1u : 0u; }
+    uint32_t operator<=(Lanes1 b) const { return v <= b.v ? 1u : 0u; }
+    uint32_t operator==(Lanes1 b) const { return v == b.v ? 1u : 0u; }
+};
+
+#if defined(NORI_BVH_SSE)
+struct Lanes4 {
+    static const int Size = 4;
+    __m128 v;
+
+    static Lanes4 load(const float *ptr) { return Lanes4 { _mm_loadu_ps(ptr) }; }
+    static Lanes4 set(float value) { return Lanes4 { _mm_set1_ps(value) }; }
+    void store(float *ptr) const { _mm_storeu_ps(ptr, v); }
+
+    Lanes4 operator+(Lanes4 b) const { return Lanes4 { _mm_add_ps(v, b.v) }; }
+    Lanes4 operator-(Lanes4 b) const { return Lanes4 { _mm_sub_ps(v, b.v) }; }
+    Lanes4 operator*(Lanes4 b) const { return Lanes4 { _mm_mul_ps(v, b.v) }; }
+    Lanes4 operator/(Lanes4 b) const { return Lanes4 { _mm_div_ps(v, b.v) }; }
+
+    Lanes4 mulsign(Lanes4 b) const {
+        return Lanes4 { _mm_xor_ps(v, _mm_and_ps(b.v, _mm_set1_ps(-0.f))) };
+    }
+    Lanes4 abs() const { return Lanes4 { _mm_andnot_ps(_mm_set1_ps(-0.f), v) }; }
+
+    uint32_t operator>=(Lanes4 b) const { return (uint32_t) _mm_movemask_ps(_mm_cmpge_ps(v, b.v)); }
+    uint32_t operator<=(Lanes4 b) const { return (uint32_t) _mm_movemask_ps(_mm_cmple_ps(v, b.v)); }
+    uint32_t operator==(Lanes4 b) const { return (uint32_t) _mm_movemask_ps(_mm_cmpeq_ps(v, b.v)); }
+};
+#endif
+
+#if defined(NORI_BVH_AVX)
+struct Lanes8 {
+    static const int Size = 8;
+    __m256 v;
+
+    static Lanes8 load(const float *ptr) { return Lanes8 { _mm256_loadu_ps(ptr) }; }
+    static Lanes8 set(float value) { return Lanes8 { _mm256_set1_ps(value) }; }
+    void store(float *ptr) const { _mm256_storeu_ps(ptr, v); }
+
+    Lanes8 operator+(Lanes8 b) const { return Lanes8 { _mm256_add_ps(v, b.v) }; }
+    Lanes8 operator-(Lanes8 b) const { return Lanes8 { _mm256_sub_ps(v, b.v) }; }
+    Lanes8 operator*(Lanes8 b) const { return Lanes8 { _mm256_mul_ps(v, b.v) }; }
+    Lanes8 operator/(Lanes8 b) const { return Lanes8 { _mm256_div_ps(v, b.v) }; }
+
+    Lanes8 mulsign(Lanes8 b) const {
+        return Lanes8 { _mm256_xor_ps(v, _mm256_and_ps(b.v, _mm256_set1_ps(-0.f))) };
+    }
+    Lanes8 abs() const { return Lanes8 { _mm256_andnot_ps(_mm256_set1_ps(-0.f), v) }; }
+
+    uint32_t operator>=(Lanes8 b) const { return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(v, b.v, _CMP_GE_OQ)); }
+    uint32_t operator<=(Lanes8 b) const { return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(v, b.v, _CMP_LE_OQ)); }
+    uint32_t operator==(Lanes8 b) const { return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(v, b.v, _CMP_EQ_OQ)); }
+};
+#endif
+
+/**
+ * Ray prepared for the watertight ray/triangle test by Woop et al.
+ * ("Watertight Ray/Triangle Intersection", JCGT 2013). Vertices are
+ * moved into a space where the ray starts at the origin and points
+ * along +z, so that the edge tests become 2D and exactly consistent
+ * for the two triangles that share an edge.
+ */
+struct WatertightRay {
+    float origin[3];
+    int kx, ky, kz;        ///< Axis permutation, z being the dominant direction
+    float Sx, Sy, Sz;      ///< Shear constants
+
+    explicit WatertightRay(const Ray3f &ray) {
+        for (int axis = 0; axis < 3; ++axis)
+            origin[axis] = ray.o[axis];
+        ray.d.cwiseAbs().maxCoeff(&kz);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        /* Preserve the winding of the triangles */
+        if (ray.d[kz] < 0)
+            std::swap(kx, ky);
+        Sz = 1.f / ray.d[kz];
+        Sx = ray.d[kx] * Sz;
+        Sy = ray.d[ky] * Sz;
+    }
+
+    /**
+     * Test all \c N triangles of a block. Returns the mask of hits in
+     * <tt>[mint, maxt]</tt> and fills in their distances and the
+     * barycentric coordinates of the second and third vertex.
+     */
+    template <int N> uint32_t intersect(const float (&p)[3][3][N], float mint, float maxt,
+                                        float *t, float *u, float *v) const {
+        uint32_t mask = 0;
+#if defined(NORI_BVH_AVX)
+        if (N == 8)
+            return intersectLanes<Lanes8>(p[0][0], p[1][0], p[2][0], N, mint, maxt, t, u, v);
+#endif
+#if defined(NORI_BVH_SSE)
+        for (int k = 0; k < N; k += 4)
+            mask |= intersectLanes<Lanes4>(p[0][0] + k, p[1][0] + k, p[2][0] + k, N,
+                                           mint, maxt, t + k, u + k, v + k) << k;
+#else
+        for (int k = 0; k < N; ++k)
+            mask |= intersectLanes<Lanes1>(p[0][0] + k, p[1][0] + k, p[2][0] + k, N,
+                                           mint, maxt, t + k, u + k, v + k) << k;
+#endif
+        return mask;
+    }
+
+    /// Test one group of lanes; \c stride separates the x, y and z arrays of a vertex
+    template <typename L> uint32_t intersectLanes(const float *p0, const float *p1, const float *p2,
+                                                  int stride, float mint, float maxt,
+                                                  float *t, float *u, float *v) const {
+        L Ax, Ay, Az, Bx, By, Bz, Cx, Cy, Cz;
+        transform<L>(p0, stride, Ax, Ay, Az);
+        transform<L>(p1, stride, Bx, By, Bz);
+        transform<L>(p2, stride, Cx, Cy, Cz);
+
+        /* Scaled barycentric coordinates: edge functions of the opposite edges */
+        L U = Cx * By - Cy * Bx,
+          V = Ax * Cy - Ay * Cx,
+          W = Bx * Ay - By * Ax;
+
+        /* Rays through an edge or vertex need the products in double precision */
+        L zero = L::set(0.f);
+        if ((U == zero) | (V == zero) | (W == zero)) {
+            float ax[L::Size], ay[L::Size], bx[L::Size], by[L::Size], cx[L::Size], cy[L::Size],
+                  us[L::Size], vs[L::Size], ws[L::Size];
+            Ax.store(ax); Ay.store(ay); Bx.store(bx); By.store(by); Cx.store(cx); Cy.store(cy);
+            for (int i = 0; i < L::Size; ++i) {
+                us[i] = (float) ((double) cx[i] * (double) by[i] - (double) cy[i] * (double) bx[i]);
+                vs[i] = (float) ((double) ax[i] * (double) cy[i] - (double) ay[i] * (double) cx[i]);
+                ws[i] = (float) ((double) bx[i] * (double) ay[i] - (double) by[i] * (double) ax[i]);
+            }
+            U = L::load(us); V = L::load(vs); W = L::load(ws);
+        }
+
+        /* Inside if all edge functions agree in sign (NaN padding never does) */
+        uint32_t mask = ((U >= zero) & (V >= zero) & (W >= zero)) |
+                        ((U <= zero) & (V <= zero) & (W <= zero));
+        if (mask == 0)
+            return 0;
+
+        L det = U + V + W;
+        L T = U * Az + V * Bz + W * Cz;
+
+        /* Compare the scaled distance against the ray segment without dividing */
+        L signedT = T.mulsign(det), absDet = det.abs();
+        mask &= ~(det == zero) & (signedT >= L::set(mint) * absDet) &
+                (signedT <= L::set(maxt) * absDet);
+        if (mask == 0)
+            return 0;
+
+        L rcpDet = L::set(1.f) / det;
+        (T * rcpDet).store(t);
+        (V * rcpDet).store(u);
+        (W * rcpDet).store(v);
+        return mask;
+    }
+
+    /// Move a vertex into the ray's sheared space
+    template <typename L> void transform(const float *p, int stride, L &x, L &y, L &z) const {
+        L px = L::load(p + kx * stride) - L::set(origin[kx]),
+          py = L::load(p + ky * stride) - L::set(origin[ky]),
+          pz = L::load(p + kz * stride) - L::set(origin[kz]);
+        x = px - L::set(Sx) * pz;
+        y = py - L::set(Sy) * pz;
+        z = L::set(Sz) * pz;
+    }
+};
+
+template <int N> bool BVH::intersectBlocks(const std::vector<TriangleBlock<N>> &blocks,
+                                           const LeafBlocks &leaf, Ray3f &ray,
+                                           Intersection &its, uint32_t &f) const {
+    bool foundIntersection = false;
+    WatertightRay wray(ray);
+
+    for (uint32_t b = leaf.first; b < leaf.first + leaf.count; ++b) {
+        const TriangleBlock<N> &block = blocks[b];
+        float t[N], u[N], v[N];
+        uint32_t mask = wray.intersect(block.p, ray.mint, ray.maxt, t, u, v);
+
+        /* Keep the closest of the hits */
+        while (mask) {
+            int i = lowestBit(mask);
+            mask &= mask - 1;
+            if (t[i] > ray.maxt)
+                continue;
+            const PrimitiveRef &prim = m_primitives[block.prim[i]];
+            foundIntersection = true;
+            ray.maxt = its.t = t[i];
+            its.uv = Point2f(u[i], v[i]);
+            its.mesh = m_shapes[prim.shape];
+            f = prim.index;
+        }
+    }
+
+    return foundIntersection;
+}
+
+template <int N> bool BVH::occludedBlocks(const std::vector<TriangleBlock<N>> &blocks,
+                                          const LeafBlocks &leaf, const Ray3f &ray) const {
+    WatertightRay wray(ray);
+
+    for (uint32_t b = leaf.first; b < leaf.first + leaf.count; ++b) {
+        float t[N], u[N], v[N];
+        if (wray.intersect(blocks[b].p, ray.mint, ray.maxt, t, u, v))
+            return true;
+    }
+
+    return false;
+}
+
+bool BVH::intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+                        Intersection &its, uint32_t &f) const {
+    bool foundIntersection = false;
+
+    bool blocks = !m_leafBlocks.empty();
+    if (blocks) {
+        const LeafBlocks &leaf = m_leafBlocks[start];
+        if (m_triangleWidth == 4)
+            foundIntersection = intersectBlocks(m_blocks4, leaf, ray, its, f);
+        else
+            foundIntersection = intersectBlocks(m_blocks8, leaf, ray, its, f);
+        if (leaf.others == 0)
+            return foundIntersection;
+    }
+
+    for (uint32_t i = start; i < end; ++i) {
+        const PrimitiveRef &prim = m_primitives[i];
+        if (blocks && m_triangleShapes[prim.shape])
+            continue;
+
+        float u, v, t;
+        uint32_t index = prim.index;
+        bool hit;
+        if (!m_triangles.empty() && m_triangleShapes[prim.shape]) {
+            const PrecomputedTriangle &tri = m_triangles[i];
+            hit = Mesh::rayIntersectTriangle(tri.p0, tri.edge1, tri.edge2, ray, u, v, t);
+        } else {
+            /* Instances report the primitive they hit inside their subscene */
+            hit = m_shapes[prim.shape]->rayIntersectDeferred(prim.index, ray, u, v, t, index);
+        }
+
+        if (hit) {
+            foundIntersection = true;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.mesh = m_shapes[prim.shape];
+            f = index;
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::occludedLeaf(uint32_t start, uint32_t end, const Ray3f &ray) const {
+    bool blocks = !m_leafBlocks.empty();
+    if (blocks) {
+        const LeafBlocks &leaf = m_leafBlocks[start];
+        bool occluded = m_triangleWidth == 4 ? occludedBlocks(m_blocks4, leaf, ray)
+                                             : occludedBlocks(m_blocks8, leaf, ray);
+        if (occluded || leaf.others == 0)
+            return occluded;
+    }
+
+    for (uint32_t i = start; i < end; ++i) {
+        const PrimitiveRef &prim = m_primitives[i];
+        if (blocks && m_triangleShapes[prim.shape])
+            continue;
+
+        if (!m_triangles.empty() && m_triangleShapes[prim.shape]) {
+            const PrecomputedTriangle &tri = m_triangles[i];
+            float u, v, t;
+            if (Mesh::rayIntersectTriangle(tri.p0, tri.edge1, tri.edge2, ray, u, v, t))
+                return true;
+        } else if (m_shapes[prim.shape]->rayOccluded(prim.index, ray)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Slab test against a node's box that also reports where the ray enters it
+static inline bool nodeIntersect(const BoundingBox3f &bbox, const Ray3f &ray, float &dist) {
+    float nearT, farT;
+    if (!bbox.rayIntersect(ray, nearT, farT) || !(ray.mint <= farT && nearT <= ray.maxt))
+        return false;
+    dist = std::max(nearT, ray.mint);
+    return true;
+}
+
+bool BVH::rayIntersectBinary(Ray3f &ray, Intersection &its, uint32_t &f) const {
+    /* Pending far children along with the distance at which the ray enters them */
+    struct StackEntry {
+        uint32_t node;
+        float dist;
+    };
+    StackEntry stack[64];
+    uint32_t node_idx = 0, stack_idx = 0;
+    bool foundIntersection = false;
+    TraversalCounters counters;
+
+    float dist;
+    counters.node();
+    if (!nodeIntersect(m_nodes[0].bbox, ray, dist))
+        return false;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+
+        if (node.isInner()) {
+            /* Children are tested here so that the nearer one can be entered
+               first; the split axis and the direction sign decide which */
+            uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+            if (ray.d[node.inner.axis] < 0)
+                std::swap(near_idx, far_idx);
+
+            float nearDist, farDist;
+            counters.node();
+            counters.node();
+            bool hitNear = nodeIntersect(m_nodes[near_idx].bbox, ray, nearDist);
+            bool hitFar = nodeIntersect(m_nodes[far_idx].bbox, ray, farDist);
+
+            if (hitNear) {
+                if (hitFar) {
+                    stack[stack_idx++] = StackEntry { far_idx, farDist };
+                    assert(stack_idx < 64);
+                }
+                node_idx = near_idx;
+                continue;
+            } else if (hitFar) {
+                node_idx = far_idx;
+                continue;
+            }
+        } else {
+            counters.leaf(node.end() - node.start());
+            if (intersectLeaf(node.start(), node.end(), ray, its, f))
+                foundIntersection = true;
+        }
+
+        /* Pop the next subtree, skipping those that start beyond the closest hit */
+        bool found = false;
+        while (stack_idx > 0) {
+            const StackEntry &entry = stack[--stack_idx];
+            if (entry.dist > ray.maxt) {
+                counters.cull();
+                continue;
+            }
+            node_idx = entry.node;
+            found = true;
+            break;
+        }
+        if (!found)
+            break;
+    }
+
+    return foundIntersection;
+}
+
+/**
+ * Ray data prepared for testing all children of a wide node at once. The
+ * near and far slab of each axis are selected based on the direction
+ * sign, so that empty slots (with inverted bounds) are never hit.
+ */
+struct WideRay {
+    float origin[3], rcp[3];
+    int near[3], far[3];
+
+    explicit WideRay(const Ray3f &ray) {
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = ray.o[axis];
+            rcp[axis] = ray.dRcp[axis];
+            bool negative = std::signbit(ray.d[axis]);
+            near[axis] = negative ? axis + 3 : axis;
+            far[axis] = negative ? axis : axis + 3;
+        }
+    }
+
+    /// Slab test against all \c N boxes; returns the hit mask and fills in the entry distances
+    template <int N> uint32_t intersect(const float (&bounds)[6][N], float mint, float maxt,
+                                        float *dist) const {
+        uint32_t mask = 0;
+
+#if defined(NORI_BVH_AVX)
+        if (N == 8) {
+            __m256 tnear = _mm256_set1_ps(mint), tfar = _mm256_set1_ps(maxt);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m256 o = _mm256_set1_ps(origin[axis]), r = _mm256_set1_ps(rcp[axis]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[near[axis]]), o), r);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[far[axis]]), o), r);
+                /* Operand order makes NaNs (0 * inf) fall back to the running interval */
+                tnear = _mm256_max_ps(t0, tnear);
+                tfar = _mm256_min_ps(t1, tfar);
+            }
+            _mm256_storeu_ps(dist, tnear);
+            mask = (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+        } else
+#endif
+        {
+#if defined(NORI_BVH_SSE)
+            for (int k = 0; k < N; k += 4) {
+                __m128 tnear = _mm_set1_ps(mint), tfar = _mm_set1_ps(maxt);
+                for (int axis = 0; axis < 3; ++axis) {
+                    __m128 o = _mm_set1_ps(origin[axis]), r = _mm_set1_ps(rcp[axis]);
+                    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[near[axis]] + k), o), r);
+                    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[far[axis]] + k), o), r);
+                    /* Operand order makes NaNs (0 * inf) fall back to the running interval */
+                    tnear = _mm_max_ps(t0, tnear);
+                    tfar = _mm_min_ps(t1, tfar);
+                }
+                _mm_storeu_ps(dist + k, tnear);
+                mask |= (uint32_t) _mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << k;
+            }
+#else
+            for (int i = 0; i < N; ++i) {
+                float tnear = mint, tfar = maxt;
+                for (int axis = 0; axis < 3; ++axis) {
+                    float t0 = (bounds[near[axis]][i] - origin[axis]) * rcp[axis];
+                    float t1 = (bounds[far[axis]][i] - origin[axis]) * rcp[axis];
+                    tnear = t0 > tnear ? t0 : tnear;
+                    tfar = t1 < tfar ? t1 : tfar;
+                }
+                dist[i] = tnear;
+                if (tnear <= tfar)
+                    mask |= 1u << i;
+            }
+#endif
+        }
+
+        return mask;
+    }
+};
+
+template <typename Node> bool BVH::rayIntersectWide(const std::vector<Node> &nodes,
+                                                    Ray3f &ray, Intersection &its, uint32_t &f) const {
+    const int N = Node::Width;
+    /* Pending children, sorted so that the closest one is on top */
+    struct StackEntry {
+        uint32_t child, count;
+        float dist;
+    };
+    StackEntry stack[64 * N];
+    uint32_t stack_idx = 0, node_idx = 0;
+    bool foundIntersection = false;
+    TraversalCounters counters;
+
+    WideRay wideRay(ray);
+
+    while (true) {
+        const Node &node = nodes[node_idx];
+        counters.node();
+        typename Node::Bounds bounds;
+        float dist[N];
+        uint32_t mask = wideRay.intersect(node.decodeBounds(bounds), ray.mint, ray.maxt, dist)
+            & node.validMask();
+
+        /* Push the children that were hit, farthest first */
+        uint32_t first = stack_idx;
+        while (mask) {
+            int i = lowestBit(mask);
+            mask &= mask - 1;
+            StackEntry entry { node.child[i], node.count[i], dist[i] };
+            uint32_t j = stack_idx++;
+            while (j > first && stack[j - 1].dist < entry.dist) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = entry;
+        }
+        assert(stack_idx < 64 * N);
+
+        /* Intersect leaves right away until the next inner node turns up */
+        bool descend = false;
+        while (stack_idx > 0) {
+            const StackEntry &entry = stack[--stack_idx];
+            if (entry.dist > ray.maxt) {
+                counters.cull();
+                continue;
+            }
+            if (entry.count == 0) {
+                node_idx = entry.child;
+                descend = true;
+                break;
+            }
+            counters.leaf(entry.count);
+            if (intersectLeaf(entry.child, entry.child + entry.count, ray, its, f))
+                foundIntersection = true;
+        }
+
+        if (!descend)
+            break;
+    }
+
+    return foundIntersection;
+}
+
+
+bool BVH::occludedBinary(const Ray3f &ray) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    TraversalCounters counters;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+        counters.node();
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                stack[stack_idx++] = node.inner.rightChild;
+                node_idx++;
+                assert(stack_idx < 64);
+                continue;
+            }
+
+            counters.leaf(node.end() - node.start());
+            if (occludedLeaf(node.start(), node.end(), ray))
+                return true;
+        }
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return false;
+}
+
+template <typename Node> bool BVH::occludedWide(const std::vector<Node> &nodes,
+                                                const Ray3f &ray) const {
+    const int N = Node::Width;
+    uint32_t stack[64 * N];
+    uint32_t stack_idx = 0, node_idx = 0;
+    TraversalCounters counters;
+
+    WideRay wideRay(ray);
+
+    while (true) {
+        const Node &node = nodes[node_idx];
+        counters.node();
+        typename Node::Bounds bounds;
+        float dist[N];
+        uint32_t mask = wideRay.intersect(node.decodeBounds(bounds), ray.mint, ray.maxt, dist)
+            & node.validMask();
+
+        /* Any hit will do: test leaves right away and defer inner nodes */
+        while (mask) {
+            int i = lowestBit(mask);
+            mask &= mask - 1;
+            if (node.count[i] == 0) {
+                stack[stack_idx++] = node.child[i];
+                continue;
+            }
+            counters.leaf(node.count[i]);
+            if (occludedLeaf(node.child[i], node.child[i] + node.count[i], ray))
+                return true;
+        }
+        assert(stack_idx < 64 * N);
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return false;
 }
 
 NORI_NAMESPACE_END
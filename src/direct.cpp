@@ -31,6 +31,14 @@ public:
 
         Color3f totalColor = Color3f(0.0f);
 
+        /* Sample all emitters first, then trace their shadow rays as one batch */
+        std::vector<EmitterQueryRecord> queries;
+        std::vector<Color3f> powers;
+        std::vector<Ray3f> shadowRays;
+        queries.reserve(lights.size());
+        powers.reserve(lights.size());
+        shadowRays.reserve(lights.size());
+
         for (Emitter* light : lights) {
             EmitterQueryRecord q = EmitterQueryRecord();
             q.ref = its.p;
@@ -40,14 +48,25 @@ public:
 
             if (cos <= 0) continue;
 
-            if (!scene->rayIntersect(q.shadowRay)) {
+            queries.push_back(q);
+            powers.push_back(power);
+            shadowRays.push_back(q.shadowRay);
+        }
+
+        std::unique_ptr<bool[]> occluded(new bool[shadowRays.size()]);
+        scene->rayIntersect(shadowRays.data(), occluded.get(), (uint32_t) shadowRays.size());
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            if (!occluded[i]) {
+                const EmitterQueryRecord &q = queries[i];
+                float cos = its.shFrame.n.dot(q.wi);
                 BSDFQueryRecord bsdfQuery = BSDFQueryRecord(
                     its.shFrame.toLocal(q.wi),
                     its.shFrame.toLocal(-ray.d),
                     ESolidAngle);
                 bsdfQuery.its = &its;
                 Color3f color = bsdf->eval(bsdfQuery);
-                totalColor += power * cos * color;
+                totalColor += powers[i] * cos * color;
             }
         }
         return totalColor;
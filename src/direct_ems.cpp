@@ -39,7 +39,7 @@ public:
         const Color3f radiance = light->sample(q, sampler->next2D());
 
         // if light is not visible return emitted light
-        if (scene->rayIntersect(q.shadowRay)) return Le;
+        if (scene->occluded(q.shadowRay)) return Le;
 
         const float cos = its.shFrame.n.dot(q.wi);
         // light source is behind (so not visible)
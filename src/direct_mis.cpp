@@ -42,7 +42,7 @@ public:
 
         Color3f Lem(0.0f);
         // if light is visible
-        if (!scene->rayIntersect(lightQuery.shadowRay)) {
+        if (!scene->occluded(lightQuery.shadowRay)) {
             const float cos = its.shFrame.n.dot(lightQuery.wi);
             // light source is not behind
             if (cos > 0) {
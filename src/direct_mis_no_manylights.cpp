@@ -33,7 +33,7 @@ public:
         Vector3f wo = its.shFrame.toLocal(-ray.d);
         Vector3f wi = its.shFrame.toLocal(eqr1.shadowRay.d);
 
-        if (!scene->rayIntersect(eqr1.shadowRay)) {
+        if (!scene->occluded(eqr1.shadowRay)) {
             // query bsdf at intersection
             BSDFQueryRecord bqr1 = BSDFQueryRecord(wo, wi, ESolidAngle);
             bqr1.its = &its;
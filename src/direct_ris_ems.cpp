@@ -68,7 +68,7 @@ public:
         }
         
         // Check visibility
-        if (scene->rayIntersect(samples[idx].shadowRay)) return res;
+        if (scene->occluded(samples[idx].shadowRay)) return res;
 
         Color3f res_chosen = samples[idx].bsdf * samples[idx].le * Frame::cosTheta(samples[idx].wi) * emitters_count / samples[idx].pdf_mat; // f(Y) / g(Y)
         return res + res_chosen / M * weigth_sum;
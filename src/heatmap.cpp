@@ -0,0 +1,127 @@
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Visualizes the BVH traversal work spent on every pixel
+ *
+ * Records one of the traversal counters ("nodes", "leaves", "primitives"
+ * or "instances", see \ref BVH::Counters) for the camera ray, or for all
+ * rays traced by a nested integrator if one is given. With a "scale" of
+ * 0, the average counts are written as they are, so that the EXR output
+ * can be inspected numerically. Otherwise, they are mapped to a blue to
+ * red ramp that saturates at "scale".
+ *
+ * Only available in builds with NORI_BVH_COUNTERS.
+ */
+class HeatMapIntegrator : public Integrator {
+public:
+    enum EMetric {
+        ENodes = 0,
+        ELeaves,
+        EPrimitives,
+        EInstances
+    };
+
+    HeatMapIntegrator(const PropertyList &props) {
+#if !defined(NORI_BVH_COUNTERS)
+        throw NoriException("HeatMapIntegrator: this build does not count BVH traversal "
+                            "work (enable NORI_BVH_COUNTERS)");
+#endif
+        std::string metric = props.getString("metric", "nodes");
+        if (metric == "nodes")
+            m_metric = ENodes;
+        else if (metric == "leaves")
+            m_metric = ELeaves;
+        else if (metric == "primitives")
+            m_metric = EPrimitives;
+        else if (metric == "instances")
+            m_metric = EInstances;
+        else
+            throw NoriException("HeatMapIntegrator: unknown metric \"%s\" (must be \"nodes\", "
+                                "\"leaves\", \"primitives\", or \"instances\")", metric);
+        m_metricName = metric;
+        m_scale = props.getFloat("scale", 0.f);
+    }
+
+    virtual ~HeatMapIntegrator() {
+        delete m_nested;
+    }
+
+    void addChild(NoriObject *obj) override {
+        if (obj->getClassType() != EIntegrator)
+            throw NoriException("HeatMapIntegrator::addChild(<%s>) is not supported!",
+                classTypeName(obj->getClassType()));
+        if (m_nested)
+            throw NoriException("HeatMapIntegrator: there can only be one nested integrator!");
+        m_nested = static_cast<Integrator *>(obj);
+    }
+
+    void preprocess(const Scene *scene) override {
+        if (m_nested)
+            m_nested->preprocess(scene);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
+#if defined(NORI_BVH_COUNTERS)
+        BVH::Counters before = BVH::getThreadCounters();
+        if (m_nested) {
+            m_nested->Li(scene, sampler, ray);
+        } else {
+            Intersection its;
+            scene->rayIntersect(ray, its);
+        }
+        BVH::Counters work = BVH::getThreadCounters() - before;
+
+        uint64_t count;
+        switch (m_metric) {
+            case ENodes: count = work.nodes; break;
+            case ELeaves: count = work.leaves; break;
+            case EPrimitives: count = work.primitives; break;
+            default: count = work.instances; break;
+        }
+
+        if (m_scale <= 0)
+            return Color3f((float) count);
+        return heat((float) count / m_scale);
+#else
+        return Color3f(0.0f);
+#endif
+    }
+
+    std::string toString() const override {
+        return tfm::format(
+            "HeatMapIntegrator[\n"
+            "  metric = %s,\n"
+            "  scale = %f,\n"
+            "  nested = %s\n"
+            "]",
+            m_metricName,
+            m_scale,
+            m_nested ? indent(m_nested->toString()) : std::string("null")
+        );
+    }
+
+private:
+    /// Blue-cyan-green-yellow-red ramp over [0, 1]
+    static Color3f heat(float t) {
+        static const Color3f ramp[5] = {
+            Color3f(0.f, 0.f, 1.f), Color3f(0.f, 1.f, 1.f), Color3f(0.f, 1.f, 0.f),
+            Color3f(1.f, 1.f, 0.f), Color3f(1.f, 0.f, 0.f)
+        };
+        t = clamp(t, 0.f, 1.f) * 4.f;
+        int i = std::min((int) t, 3);
+        float f = t - i;
+        return ramp[i] * (1.f - f) + ramp[i + 1] * f;
+    }
+
+    EMetric m_metric;
+    std::string m_metricName;
+    float m_scale;
+    Integrator *m_nested = nullptr;
+};
+
+NORI_REGISTER_CLASS(HeatMapIntegrator, "heatmap");
+NORI_NAMESPACE_END
@@ -19,8 +19,18 @@
 #include <nori/object.h>
 #include <nori/texture.h>
 #include <nori/shape.h>
+#include <nori/registry.h>
+#include <nori/texcache.h>
+#include <filesystem/path.h>
 #include <stb_image.h>
 #include <tbb/tbb.h>
+#include <sys/stat.h>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 
 NORI_NAMESPACE_BEGIN
 
@@ -53,6 +63,29 @@ float inverseGammaCorrect(float value) {
     return std::pow((value + 0.055f) * 1.f / 1.055f, 2.4f);
 }
 
+/// Linear values of the 256 8-bit sRGB codes
+static const std::array<float, 256> SRGB_TABLE = []() {
+    std::array<float, 256> table;
+    for (int i = 0; i < 256; ++i)
+        table[i] = inverseGammaCorrect(i / 255.0f);
+    return table;
+}();
+
+/// Closest 8-bit sRGB code of a linear value in [0, 1]
+uint8_t gammaCorrect8(float value) {
+    value = clamp(value, 0.f, 1.f);
+    if (value <= 0.0031308f)
+        value *= 12.92f;
+    else
+        value = 1.055f * std::pow(value, 1.f / 2.4f) - 0.055f;
+    return (uint8_t) clamp((int) std::round(value * 255.0f), 0, 255);
+}
+
+/// Texel stored as 8-bit sRGB, which is decoded through \ref SRGB_TABLE
+struct SRGB8 {
+    uint8_t r, g, b;
+};
+
 float* convertFloatImage(uint8_t* rgb_image, int width, int height) {
     float* m_map = new float[width * height];
     unsigned char* pixel = rgb_image;
@@ -70,9 +103,9 @@ Color3f* convertColorImage(uint8_t* rgb_image, int width, int height) {
     for (int j = height - 1; j >= 0; j--) { // flip y coordinates
         for (int i = 0; i < width; i++, pixel += 3) {
             m_map[j * width + i] = Color3f(
-                inverseGammaCorrect(pixel[0] / 255.0f),
-                inverseGammaCorrect(pixel[1] / 255.0f),
-                inverseGammaCorrect(pixel[2] / 255.0f)
+                SRGB_TABLE[pixel[0]],
+                SRGB_TABLE[pixel[1]],
+                SRGB_TABLE[pixel[2]]
             );
         }
     }
@@ -154,12 +187,28 @@ struct ResampleWeight {
     float weight[4];
 };
 
+/**
+ * \brief Texels of a mip level
+ *
+ * They are stored in blocks of 4x4 texels, so that the taps of a
+ * bilinear lookup and of neighbouring lookups mostly share cache lines
+ * instead of straddling rows. \c buf is given in row-major order.
+ */
 template <typename T>
 class UVArray {
 public:
     UVArray(int uRes, int vRes, const T* buf = nullptr) : uRes(uRes), vRes(vRes) {
-        buffer = new T[uRes * vRes];
-        if (buf) for (int i = 0; i < uRes * vRes; i++) buffer[i] = buf[i];
+        uBlocks = (uRes + BLOCK_SIZE - 1) >> BLOCK_BITS;
+        vBlocks = (vRes + BLOCK_SIZE - 1) >> BLOCK_BITS;
+        buffer = new T[(size_t) uBlocks * vBlocks * BLOCK_SIZE * BLOCK_SIZE];
+        if (buf)
+            for (int v = 0; v < vRes; v++)
+                for (int u = 0; u < uRes; u++)
+                    (*this)(u, v) = buf[v * uRes + u];
+    }
+
+    ~UVArray() {
+        delete[] buffer;
     }
 
     int uSize() const {
@@ -171,19 +220,50 @@ public:
     }
 
     T &operator()(int u, int v) {
-        return buffer[v * uRes + u];
+        return buffer[index(u, v)];
+    }
+
+    const T &operator()(int u, int v) const {
+        return buffer[index(u, v)];
+    }
+
+    size_t getMemoryUsage() const {
+        return sizeof(T) * uBlocks * vBlocks * BLOCK_SIZE * BLOCK_SIZE;
     }
 private:
+    static constexpr int BLOCK_BITS = 2;
+    static constexpr int BLOCK_SIZE = 1 << BLOCK_BITS;
+
+    size_t index(int u, int v) const {
+        size_t block = (size_t) (v >> BLOCK_BITS) * uBlocks + (u >> BLOCK_BITS);
+        return (block << (2 * BLOCK_BITS)) |
+            ((v & (BLOCK_SIZE - 1)) << BLOCK_BITS) | (u & (BLOCK_SIZE - 1));
+    }
+
     int uRes;
     int vRes;
+    int uBlocks;
+    int vBlocks;
     T *buffer;
 };
 
+/// Header of the tile files written by \ref MipMap::makeTiled()
+struct TileFileHeader {
+    char magic[8];        ///< "NORITEX"
+    uint32_t version;     ///< Bumped whenever the layout of the file changes
+    uint32_t texelSize;   ///< Bytes per texel
+    uint64_t key;         ///< Hash of the source image, its size and time stamp, channels and wrap mode
+    uint32_t tileSize;    ///< Texels per side of a tile
+    uint32_t levelCount;  ///< Followed by the resolution of every level, then the tiles
+};
+
+static constexpr char TILE_FILE_MAGIC[8] = "NORITEX";
+static constexpr uint32_t TILE_FILE_VERSION = 1;
 
 template <typename T>
-class MipMap {
+class MipMap : public TextureData {
 public:
-    MipMap(const T *img, Point2i &res, WrapMethod wrap) : res(res), wrap(wrap) {
+    MipMap(const T *img, Point2i res, WrapMethod wrap) : res(res), wrap(wrap) {
         Point2i newRes((1 << int(ceil(log2(res.x())))), (1 << int(ceil(log2(res.y())))));
 
         std::unique_ptr<T[]> resampledImage = nullptr;
@@ -246,12 +326,14 @@ public:
         pyramid[0].reset(
             new UVArray<T>(res.x(), res.y(), resampledImage ? resampledImage.get() : img)
         );
+        levels.push_back(Level { res.x(), res.y() });
 
         for (int i = 1; i < nLevels; i++) {
             int uRes = std::max(1, pyramid[i - 1]->uSize() / 2);
             int vRes = std::max(1, pyramid[i - 1]->vSize() / 2);
 
             pyramid[i].reset(new UVArray<T>(uRes, vRes));
+            levels.push_back(Level { uRes, vRes });
 
             tbb::parallel_for(
                 tbb::blocked_range<uint32_t>(0u, vRes, 16), // what is grain size
@@ -272,6 +354,103 @@ public:
         }
     }
 
+    ~MipMap() {
+        if (source != NO_SOURCE)
+            TextureCache::get().removeSource(source);
+    }
+
+    /**
+     * \brief Map the tiles written by an earlier run
+     *
+     * Returns \c nullptr if \c filename does not exist or was written
+     * for a different \c key.
+     */
+    static std::shared_ptr<MipMap> loadTiled(const std::string &filename, uint64_t key,
+                                             WrapMethod wrap, bool compact) {
+        std::shared_ptr<MipMap> result(new MipMap(wrap, compact));
+        if (!result->mapTiles(filename, key))
+            return nullptr;
+        return result;
+    }
+
+    /**
+     * \brief Store all levels as 8-bit sRGB
+     *
+     * This takes a quarter of the memory of \ref Color3f texels. The
+     * levels are still filtered at full precision before, and for
+     * power-of-two images, the finest level decodes to exactly the
+     * values it had before.
+     */
+    void compact() {
+        packed.resize(pyramid.size());
+        for (size_t level = 0; level < pyramid.size(); ++level) {
+            UVArray<T> &l = *pyramid[level];
+            packed[level].reset(new UVArray<SRGB8>(l.uSize(), l.vSize()));
+            for (int v = 0; v < l.vSize(); ++v)
+                for (int u = 0; u < l.uSize(); ++u)
+                    (*packed[level])(u, v) = encode(l(u, v));
+        }
+        pyramid.clear();
+        compactTexels = true;
+    }
+
+    /**
+     * \brief Move the pyramid to a tile file
+     *
+     * Afterwards, lookups only bring the tiles they touch into the
+     * \ref TextureCache. If the file cannot be written, the pyramid
+     * stays resident.
+     */
+    void makeTiled(const std::string &filename, uint64_t key) {
+        TileFileHeader header;
+        memset(&header, 0, sizeof(TileFileHeader));
+        memcpy(header.magic, TILE_FILE_MAGIC, sizeof(header.magic));
+        header.version = TILE_FILE_VERSION;
+        header.texelSize = (uint32_t) texelSize();
+        header.key = key;
+        header.tileSize = TILE_SIZE;
+        header.levelCount = (uint32_t) levels.size();
+
+        /* Write to a temporary file first, so that concurrent renders
+           never map a partially written tile file */
+        std::ostringstream tempName;
+        tempName << filename << "." << std::hex << (uintptr_t) this << ".tmp";
+        {
+            std::ofstream os(tempName.str(), std::ios::binary);
+            os.write((const char *) &header, sizeof(TileFileHeader));
+            for (const Level &l : levels) {
+                int32_t resolution[2] = { l.uRes, l.vRes };
+                os.write((const char *) resolution, sizeof(resolution));
+            }
+
+            if (compactTexels)
+                writeTiles(os, packed);
+            else
+                writeTiles(os, pyramid);
+            if (!os) {
+                cerr << "Warning: could not write texture tiles \"" << tempName.str() << "\"" << endl;
+                std::remove(tempName.str().c_str());
+                return;
+            }
+        }
+
+        if (std::rename(tempName.str().c_str(), filename.c_str()) != 0) {
+            /* Windows does not replace existing files */
+            std::remove(filename.c_str());
+            if (std::rename(tempName.str().c_str(), filename.c_str()) != 0) {
+                cerr << "Warning: could not write texture tiles \"" << filename << "\"" << endl;
+                std::remove(tempName.str().c_str());
+                return;
+            }
+        }
+
+        levels.clear();
+        if (!mapTiles(filename, key))
+            throw NoriException("MipMap: could not read back the tiles in \"%s\"", filename);
+        pyramid.clear();
+        packed.clear();
+    }
+
     T debug(const Color3f &d) const;
 
     T Lookup(const Point2f &uv, const Vector2f &duvdx, const Vector2f& duvdy) const {
@@ -280,16 +459,16 @@ public:
             std::max(std::abs(duvdy[0]), std::abs(duvdy[1]))
         );
 
-        float level = pyramid.size() - 1 + log2(std::max(w, float(1e-8)));
+        float level = levels.size() - 1 + log2(std::max(w, float(1e-8)));
 
         if (DEBUG) {
-            return debug(DEBUG_COLORS[clamp(int(level), 0, pyramid.size())]);
+            return debug(DEBUG_COLORS[clamp(int(level), 0, levels.size())]);
         }
 
         if (level < 0)
             return triangle(0, uv);
-        else if (level >= pyramid.size() - 1) {
-            return eval(pyramid.size() - 1, 0, 0);
+        else if (level >= levels.size() - 1) {
+            return eval(levels.size() - 1, 0, 0);
         }
         else {
             int iLevel = std::floor(level);
@@ -299,7 +478,111 @@ public:
         return 0.0f;
     };
 
+    virtual size_t getMemoryUsage() const override {
+        size_t size = 0;
+        for (auto &level : pyramid)
+            size += level->getMemoryUsage();
+        for (auto &level : packed)
+            size += level->getMemoryUsage();
+        return size;
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format("%ix%i, %i levels%s%s", levels[0].uRes, levels[0].vRes, levels.size(),
+                           compactTexels ? ", 8-bit sRGB" : "", source != NO_SOURCE ? ", tiled" : "");
+    }
+
 private:
+    static constexpr int TILE_SIZE = TextureCache::TILE_SIZE;
+    static constexpr uint32_t NO_SOURCE = (uint32_t) -1;
+
+    /// Resolution of a level, and where its tiles start once the pyramid is tiled
+    struct Level {
+        int uRes, vRes;
+        int tilesU = 0;
+        uint32_t firstTile = 0;
+    };
+
+    /// The tile that the last texel fetch of a lookup came from
+    struct TileRef {
+        uint32_t index = (uint32_t) -1;
+        const TextureCache::Tile *tile = nullptr;
+    };
+
+    MipMap(WrapMethod wrap, bool compact) : compactTexels(compact), wrap(wrap) { }
+
+    size_t texelSize() const {
+        return compactTexels ? sizeof(SRGB8) : sizeof(T);
+    }
+
+    static SRGB8 encode(const T &value);
+    static T decode(const SRGB8 &texel);
+
+    /// Write the levels in \c arrays as tiles. Partial tiles at the right and top are padded
+    template <typename S>
+    void writeTiles(std::ostream &os, const std::vector<std::unique_ptr<UVArray<S>>> &arrays) const {
+        std::unique_ptr<S[]> tile(new S[TILE_SIZE * TILE_SIZE]);
+        for (auto &array : arrays) {
+            UVArray<S> &l = *array;
+            for (int tv = 0; tv < l.vSize(); tv += TILE_SIZE) {
+                for (int tu = 0; tu < l.uSize(); tu += TILE_SIZE) {
+                    for (int j = 0; j < TILE_SIZE; ++j)
+                        for (int i = 0; i < TILE_SIZE; ++i)
+                            tile[j * TILE_SIZE + i] = tu + i < l.uSize() && tv + j < l.vSize()
+                                ? l(tu + i, tv + j) : S();
+                    os.write((const char *) tile.get(), sizeof(S) * TILE_SIZE * TILE_SIZE);
+                }
+            }
+        }
+    }
+
+    /// Register the tile file \c filename with the texture cache
+    bool mapTiles(const std::string &filename, uint64_t key) {
+        if (!filesystem::path(filename).exists())
+            return false;
+        try {
+            std::unique_ptr<MemoryMappedFile> file(new MemoryMappedFile(filename));
+            if (file->size() < sizeof(TileFileHeader))
+                return false;
+
+            TileFileHeader header;
+            memcpy(&header, file->data(), sizeof(TileFileHeader));
+            if (memcmp(header.magic, TILE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version != TILE_FILE_VERSION || header.key != key ||
+                header.texelSize != texelSize() || header.tileSize != TILE_SIZE ||
+                header.levelCount == 0)
+                return false;
+
+            size_t offset = sizeof(TileFileHeader) + header.levelCount * 2 * sizeof(int32_t);
+            if (file->size() < offset)
+                return false;
+            const uint8_t *ptr = file->data() + sizeof(TileFileHeader);
+            uint32_t tileCount = 0;
+            for (uint32_t i = 0; i < header.levelCount; ++i) {
+                int32_t resolution[2];
+                memcpy(resolution, ptr + i * sizeof(resolution), sizeof(resolution));
+                Level l { resolution[0], resolution[1] };
+                l.tilesU = (l.uRes + TILE_SIZE - 1) / TILE_SIZE;
+                l.firstTile = tileCount;
+                tileCount += l.tilesU * ((l.vRes + TILE_SIZE - 1) / TILE_SIZE);
+                levels.push_back(l);
+            }
+
+            size_t tileBytes = texelSize() * TILE_SIZE * TILE_SIZE;
+            if (file->size() != offset + tileCount * tileBytes) {
+                levels.clear();
+                return false;
+            }
+            res = Point2i(levels[0].uRes, levels[0].vRes);
+            source = TextureCache::get().addSource(std::move(file), offset, tileBytes);
+        } catch (const NoriException &e) {
+            cerr << "Warning: could not read texture tiles: " << e.what() << endl;
+            levels.clear();
+            return false;
+        }
+        return true;
+    }
+
     std::unique_ptr<ResampleWeight[]> resampleWeights(int oldRes, int newRes) {
         std::unique_ptr<ResampleWeight[]> weights(new ResampleWeight[newRes]);
         float filterwidth = 2.f;
@@ -324,37 +607,66 @@ private:
         return weights;
     }
 
-    T eval(int level, int i, int j) const {
-        UVArray<T> &l = *pyramid[level];
-        if (wrap == WrapMethod::Clamp) {
-            i = clamp(i, 0, l.uSize()-1);
-            j = clamp(j, 0, l.vSize()-1);
-        }
-        else if (wrap == WrapMethod::Repeat) {
-            i = mod(i, l.uSize());
-            j = mod(j, l.vSize());
-        }
+    /// Apply the wrap mode to the texel coordinate \c i of a level with resolution \c res
+    int wrapCoordinate(int i, int res) const {
+        /* All levels have power-of-two resolutions */
+        if (wrap == WrapMethod::Clamp)
+            return clamp(i, 0, res - 1);
+        else if (wrap == WrapMethod::Repeat)
+            return i & (res - 1);
         else
             throw NoriException("unknown wrap method");
+    }
+
+    T eval(int level, int i, int j, TileRef *ref = nullptr) const {
+        const Level &l = levels[level];
+        return fetch(level, wrapCoordinate(i, l.uRes), wrapCoordinate(j, l.vRes), ref);
+    }
 
-        return l(i, j);
+    /// Fetch a texel inside the level. Consecutive fetches that pass the same \c ref only look up a new tile when they leave the last one
+    T fetch(int level, int i, int j, TileRef *ref = nullptr) const {
+        const Level &l = levels[level];
+        if (source == NO_SOURCE)
+            return compactTexels ? decode((*packed[level])(i, j)) : (*pyramid[level])(i, j);
+
+        TileRef local;
+        if (!ref)
+            ref = &local;
+        uint32_t index = l.firstTile + (j / TILE_SIZE) * l.tilesU + i / TILE_SIZE;
+        if (ref->index != index) {
+            ref->tile = TextureCache::get().getTile(source, index);
+            ref->index = index;
+        }
+        const uint8_t *data = ref->tile->data();
+        int texel = (j % TILE_SIZE) * TILE_SIZE + i % TILE_SIZE;
+        return compactTexels ? decode(((const SRGB8 *) data)[texel]) : ((const T *) data)[texel];
     }
 
     T triangle(int level, const Point2f& uv) const {
-        level = clamp(level, 0, pyramid.size() - 1);
-        float u = uv.x() * pyramid[level]->uSize() - 0.5f;
-        float v = uv.y() * pyramid[level]->vSize() - 0.5f;
+        level = clamp(level, 0, levels.size() - 1);
+        const Level &l = levels[level];
+        float u = uv.x() * l.uRes - 0.5f;
+        float v = uv.y() * l.vRes - 0.5f;
         int u0 = std::floor(u);
         int v0 = std::floor(v);
         float du = u - u0, dv = v - v0;
-        return (1 - du) * (1 - dv) * eval(level, u0, v0) +
-            (1 - du) * dv * eval(level, u0, v0 + 1) +
-            du * (1 - dv) * eval(level, u0 + 1, v0) +
-            du * dv * eval(level, u0 + 1, v0 + 1);
+        /* Wrap the texel coordinates once for all four taps */
+        int u1 = wrapCoordinate(u0 + 1, l.uRes), v1 = wrapCoordinate(v0 + 1, l.vRes);
+        u0 = wrapCoordinate(u0, l.uRes);
+        v0 = wrapCoordinate(v0, l.vRes);
+        TileRef ref;
+        return (1 - du) * (1 - dv) * fetch(level, u0, v0, &ref) +
+            (1 - du) * dv * fetch(level, u0, v1, &ref) +
+            du * (1 - dv) * fetch(level, u1, v0, &ref) +
+            du * dv * fetch(level, u1, v1, &ref);
     }
 
     Point2i res;
     std::vector<std::unique_ptr<UVArray<T>>> pyramid;
+    std::vector<std::unique_ptr<UVArray<SRGB8>>> packed;  ///< Levels after \ref compact()
+    bool compactTexels = false;
+    std::vector<Level> levels;
+    uint32_t source = NO_SOURCE;  ///< Tile file in the \ref TextureCache, if the pyramid is tiled
     const WrapMethod wrap;
 };
 
@@ -368,22 +680,94 @@ float MipMap<float>::debug(const Color3f &d) const {
     return 1.0f;
 }
 
+template <>
+SRGB8 MipMap<Color3f>::encode(const Color3f &value) {
+    return SRGB8 { gammaCorrect8(value.r()), gammaCorrect8(value.g()), gammaCorrect8(value.b()) };
+}
+
+template <>
+Color3f MipMap<Color3f>::decode(const SRGB8 &texel) {
+    return Color3f(SRGB_TABLE[texel.r], SRGB_TABLE[texel.g], SRGB_TABLE[texel.b]);
+}
+
+/* Float textures are averages of linear 8-bit values, which sRGB codes cannot represent */
+template <>
+SRGB8 MipMap<float>::encode(const float &) {
+    throw NoriException("MipMap: 8-bit sRGB texels are only available for color textures");
+}
+
+template <>
+float MipMap<float>::decode(const SRGB8 &) {
+    return 0.0f;
+}
+
 template <typename T>
 class ImageTexture : public Texture<T> {
 public:
     ImageTexture(const PropertyList& props) {
         std::string filename = props.getString("filename");
-        int bpp;
-
-        uint8_t* rgb_image = stbi_load(filename.c_str(), &m_width, &m_height, &bpp, 3);
-
-        T* m_map = convertImage(rgb_image);
 
         std::string wrap = props.getString("wrap", "repeat");
         if (wrap == "repeat") m_wrap = WrapMethod::Repeat;
         else if (wrap == "clamp") m_wrap = WrapMethod::Clamp;
 
-        mipmap = new MipMap<T>(m_map, Point2i(m_width, m_height), m_wrap);
+        /* Keep the pyramid in a tile file and only load the tiles that are used (see TextureCache) */
+        bool tiled = props.getBoolean("tiled", false);
+        /* Store color texels as 8-bit sRGB */
+        bool compact = props.getBoolean("compact", false);
+
+        /* Textures of the same image only differ in their scale and offset, so they share one pyramid */
+        std::string channelType = channels() + (compact ? ", 8-bit" : "") + (tiled ? ", tiled" : "");
+        mipmap = TextureRegistry::get().acquire<MipMap<T>>(filename, channelType, wrap, [&]() {
+            std::string tileFile;
+            uint64_t tileKey = 0;
+            if (tiled) {
+                struct stat info;
+                if (stat(filename.c_str(), &info) != 0)
+                    throw NoriException("Unable to open texture \"%s\"!", filename);
+
+                tileKey = hashValue(TILE_FILE_VERSION);
+                tileKey = hashBytes(filename.data(), filename.size(), tileKey);
+                tileKey = hashBytes(channelType.data(), channelType.size(), tileKey);
+                tileKey = hashBytes(wrap.data(), wrap.size(), tileKey);
+                tileKey = hashValue((uint64_t) info.st_size, tileKey);
+                tileKey = hashValue((int64_t) info.st_mtime, tileKey);
+
+                filesystem::path path(filename);
+                std::ostringstream name;
+                name << path.filename() << "." << std::hex << std::setw(16) << std::setfill('0')
+                     << tileKey << ".tiles";
+                std::string directory = props.getString("cacheDirectory", "");
+                if (directory.empty()) {
+                    tileFile = (path.parent_path() / filesystem::path(name.str())).str();
+                } else {
+                    filesystem::path dir(directory);
+                    if (!dir.exists())
+                        filesystem::create_directory(dir);
+                    tileFile = (dir / filesystem::path(name.str())).str();
+                }
+
+                /* Tiles written by an earlier run make decoding the image unnecessary */
+                if (std::shared_ptr<MipMap<T>> result = MipMap<T>::loadTiled(tileFile, tileKey, m_wrap, compact))
+                    return result;
+            }
+
+            int bpp;
+            uint8_t* rgb_image = stbi_load(filename.c_str(), &m_width, &m_height, &bpp, 3);
+            if (!rgb_image)
+                throw NoriException("Unable to open texture \"%s\"!", filename);
+
+            std::unique_ptr<T[]> m_map(convertImage(rgb_image));
+            stbi_image_free(rgb_image);
+
+            std::shared_ptr<MipMap<T>> result =
+                std::make_shared<MipMap<T>>(m_map.get(), Point2i(m_width, m_height), m_wrap);
+            if (compact)
+                result->compact();
+            if (tiled)
+                result->makeTiled(tileFile, tileKey);
+            return result;
+        });
 
         m_delta = props.getPoint2("delta", Point2f(0.0f));
         m_scale = props.getVector2("scale", Vector2f(1.0f));
@@ -411,10 +795,13 @@ public:
     }
 private:
     T* convertImage(uint8_t* rgb_image);
+
+    /// Channel type for the texture registry
+    static std::string channels();
 protected:
     Point2f m_delta;
     Vector2f m_scale;
-    const MipMap<T>* mipmap;
+    std::shared_ptr<const MipMap<T>> mipmap;
     int m_width;
     int m_height;
     WrapMethod m_wrap;
@@ -430,6 +817,16 @@ protected:
      return convertFloatImage(rgb_image, m_width, m_height);
  }
 
+template <>
+std::string ImageTexture<Color3f>::channels() {
+    return "color";
+}
+
+template <>
+std::string ImageTexture<float>::channels() {
+    return "float";
+}
+
 NORI_REGISTER_TEMPLATED_CLASS(ImageTextureSimple, Color3f, "image_texture_simple_color")
 NORI_REGISTER_TEMPLATED_CLASS(ImageTextureSimple, float, "image_texture_simple_float")
 NORI_REGISTER_TEMPLATED_CLASS(ImageTexture, Color3f, "image_texture_color")
@@ -22,10 +22,93 @@
 #include <nori/emitter.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
+#include <limits>
 
 NORI_NAMESPACE_BEGIN
 
-Mesh::Mesh() { }
+Mesh::Mesh() : m_geometry(std::make_shared<Geometry>()) { }
+
+/// Map a point of the octahedron |x| + |y| + |z| = 1 to the unit square and back (lower half folded)
+static inline Vector2f octWrap(const Vector2f &v) {
+    return Vector2f((1.f - std::abs(v.y())) * (v.x() >= 0 ? 1.f : -1.f),
+                    (1.f - std::abs(v.x())) * (v.y() >= 0 ? 1.f : -1.f));
+}
+
+static inline Vector3f octDecode(float x, float y) {
+    Vector3f n(x, y, 1.f - std::abs(x) - std::abs(y));
+    if (n.z() < 0) {
+        Vector2f w = octWrap(Vector2f(x, y));
+        n.x() = w.x();
+        n.y() = w.y();
+    }
+    return n.normalized();
+}
+
+/**
+ * Encode a unit vector on the octahedron with two 16-bit signed normalized
+ * values. Of the four neighboring grid points, the one that decodes
+ * closest to \c n is kept ("precise" variant in Cigolle et al., "A Survey
+ * of Efficient Representations for Independent Unit Vectors", JCGT 2014)
+ */
+static inline void octEncode(const Vector3f &n, int16_t &x, int16_t &y) {
+    Vector2f p = Vector2f(n.x(), n.y()) / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+    if (n.z() < 0)
+        p = octWrap(p);
+
+    float bestError = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 4; ++i) {
+        float cx = (i & 1) ? std::ceil(p.x() * 32767.f) : std::floor(p.x() * 32767.f);
+        float cy = (i & 2) ? std::ceil(p.y() * 32767.f) : std::floor(p.y() * 32767.f);
+        cx = clamp(cx, -32767.f, 32767.f);
+        cy = clamp(cy, -32767.f, 32767.f);
+        float error = (octDecode(cx / 32767.f, cy / 32767.f) - n).squaredNorm();
+        if (error < bestError) {
+            bestError = error;
+            x = (int16_t) cx;
+            y = (int16_t) cy;
+        }
+    }
+}
+
+Normal3f Mesh::Geometry::getNormal(uint32_t vertex) const {
+    if (Noct.size() > 0)
+        return octDecode(Noct(0, vertex) * (1.f / 32767.f), Noct(1, vertex) * (1.f / 32767.f));
+    return N.col(vertex);
+}
+
+size_t Mesh::Geometry::compact(bool normals, bool texCoords, bool indices) {
+    size_t before = getMemoryUsage();
+
+    if (normals && N.size() > 0) {
+        Noct.resize(2, N.cols());
+        for (Eigen::Index i = 0; i < N.cols(); ++i) {
+            Vector3f n = N.col(i);
+            float length = n.norm();
+            if (length > 0)
+                octEncode(n / length, Noct(0, i), Noct(1, i));
+            else
+                Noct(0, i) = Noct(1, i) = 0;
+        }
+        N.resize(0, 0);
+    }
+
+    if (texCoords && UV.size() > 0) {
+        UVh = UV.cast<Eigen::half>();
+        UV.resize(0, 0);
+    }
+
+    if (indices && F.size() > 0 && V.cols() <= 65536) {
+        F16 = F.cast<uint16_t>();
+        F.resize(0, 0);
+    }
+
+    return before - getMemoryUsage();
+}
+
+size_t Mesh::Geometry::getMemoryUsage() const {
+    return sizeof(float) * (V.size() + N.size() + UV.size()) + sizeof(uint32_t) * F.size() +
+        sizeof(int16_t) * Noct.size() + sizeof(Eigen::half) * UVh.size() + sizeof(uint16_t) * F16.size();
+}
 
 void Mesh::activate() {
     Shape::activate();
@@ -37,20 +120,45 @@ void Mesh::activate() {
     m_pdf.normalize();
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V) {
+    if (V.rows() != 3 || V.cols() != getVertexCount())
+        throw NoriException("Mesh \"%s\": expected %i new vertex positions, got %i",
+                            m_name, getVertexCount(), V.cols());
+
+    /* Other meshes may share the old positions */
+    if (m_geometry.use_count() > 1 + (long) m_geometry->bvhReferences) {
+        m_geometry = std::make_shared<Geometry>(*m_geometry);
+        m_geometry->bvhReferences = 0;
+    }
+    m_geometry->V = V;
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < getVertexCount(); ++i)
+        m_bbox.expandBy(V.col(i));
+
+    m_pdf.clear();
+    m_pdf.reserve(getPrimitiveCount());
+    for (uint32_t i = 0; i < getPrimitiveCount(); ++i)
+        m_pdf.append(surfaceArea(i));
+    m_pdf.normalize();
+}
+
 void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const {
+    const MatrixXf &V = m_geometry->V;
+
     Point2f s = sample;
     size_t idT = m_pdf.sampleReuse(s.x());
 
     Vector3f bc = Warp::squareToUniformTriangle(s);
 
     sRec.p = getInterpolatedVertex(idT,bc);
-    if (m_N.size() > 0) {
+    if (m_geometry->hasNormals()) {
         sRec.n = getInterpolatedNormal(idT, bc);
     }
     else {
-        Point3f p0 = m_V.col(m_F(0, idT));
-        Point3f p1 = m_V.col(m_F(1, idT));
-        Point3f p2 = m_V.col(m_F(2, idT));
+        Point3f p0 = V.col(getVertexIndex(0, idT));
+        Point3f p1 = V.col(getVertexIndex(1, idT));
+        Point3f p2 = V.col(getVertexIndex(2, idT));
         Normal3f n = (p1-p0).cross(p2-p0).normalized();
         sRec.n = n;
     }
@@ -61,32 +169,46 @@ float Mesh::pdfSurface(const ShapeQueryRecord & sRec) const {
 }
 
 Point3f Mesh::getInterpolatedVertex(uint32_t index, const Vector3f &bc) const {
-    return (bc.x() * m_V.col(m_F(0, index)) +
-            bc.y() * m_V.col(m_F(1, index)) +
-            bc.z() * m_V.col(m_F(2, index)));
+    const MatrixXf &V = m_geometry->V;
+
+    return (bc.x() * V.col(getVertexIndex(0, index)) +
+            bc.y() * V.col(getVertexIndex(1, index)) +
+            bc.z() * V.col(getVertexIndex(2, index)));
 }
 
 Normal3f Mesh::getInterpolatedNormal(uint32_t index, const Vector3f &bc) const {
-    return (bc.x() * m_N.col(m_F(0, index)) +
-            bc.y() * m_N.col(m_F(1, index)) +
-            bc.z() * m_N.col(m_F(2, index))).normalized();
+    const Geometry &G = *m_geometry;
+
+    return (bc.x() * G.getNormal(G.getIndex(0, index)) +
+            bc.y() * G.getNormal(G.getIndex(1, index)) +
+            bc.z() * G.getNormal(G.getIndex(2, index))).normalized();
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    const MatrixXf &V = m_geometry->V;
+
+    uint32_t i0 = getVertexIndex(0, index), i1 = getVertexIndex(1, index), i2 = getVertexIndex(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const MatrixXf &V = m_geometry->V;
+
+    uint32_t i0 = getVertexIndex(0, index), i1 = getVertexIndex(1, index), i2 = getVertexIndex(2, index);
+    const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
 
+    return rayIntersectTriangle(p0, edge1, edge2, ray, u, v, t);
+}
+
+bool Mesh::rayIntersectTriangle(const Point3f &p0, const Vector3f &edge1,
+                                const Vector3f &edge2, const Ray3f &ray,
+                                float &u, float &v, float &t) {
     /* Begin calculating determinant - also used to calculate U parameter */
     Vector3f pvec = ray.d.cross(edge2);
 
@@ -120,24 +242,27 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 }
 
 void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
+    const Geometry &G = *m_geometry;
+    const MatrixXf &V = G.V;
+
     /* Find the barycentric coordinates */
     Vector3f bary;
     bary << 1-its.uv.sum(), its.uv;
 
     /* Vertex indices of the triangle */
-    uint32_t idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
+    uint32_t idx0 = G.getIndex(0, index), idx1 = G.getIndex(1, index), idx2 = G.getIndex(2, index);
 
-    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
 
     /* Compute the intersection positon accurately
        using barycentric coordinates */
     its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
 
     /* Compute proper texture coordinates if provided by the mesh */
-    if (m_UV.size() > 0) {
-        Point2f uv0 = m_UV.col(idx0);
-        Point2f uv1 = m_UV.col(idx1);
-        Point2f uv2 = m_UV.col(idx2);
+    if (G.hasTexCoords()) {
+        Point2f uv0 = G.getTexCoord(idx0);
+        Point2f uv1 = G.getTexCoord(idx1);
+        Point2f uv2 = G.getTexCoord(idx2);
         Vector2f duv02 = uv0 - uv2, duv12 = uv1 - uv2;
         Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
         float det = duv02[0] * duv12[1] - duv02[1] * duv12[0];
@@ -157,16 +282,16 @@ void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & it
     /* Compute the geometry frame */
     its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
 
-    if (m_N.size() > 0) {
+    if (G.hasNormals()) {
         /* Compute the shading frame. Note that for simplicity,
            the current implementation doesn't attempt to provide
            tangents that are continuous across the surface. That
            means that this code will need to be modified to be able
            use anisotropic BRDFs, which need tangent continuity */
         Normal3f n = (
-            bary.x() * m_N.col(idx0) +
-            bary.y() * m_N.col(idx1) +
-            bary.z() * m_N.col(idx2)).normalized();
+            bary.x() * G.getNormal(idx0) +
+            bary.y() * G.getNormal(idx1) +
+            bary.z() * G.getNormal(idx2)).normalized();
         Vector3f s = (its.dpdu + n * n.dot(its.dpdu)).normalized();
         its.shFrame = Frame(s, n.cross(s), n);
     } else {
@@ -177,16 +302,20 @@ void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & it
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    const MatrixXf &V = m_geometry->V;
+
+    BoundingBox3f result(V.col(getVertexIndex(0, index)));
+    result.expandBy(V.col(getVertexIndex(1, index)));
+    result.expandBy(V.col(getVertexIndex(2, index)));
     return result;
 }
 
 LightCone Mesh::getLightCone(uint32_t index) const {
+    const MatrixXf &V = m_geometry->V;
+
     LightCone res;
-    uint32_t idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
-    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+    uint32_t idx0 = getVertexIndex(0, index), idx1 = getVertexIndex(1, index), idx2 = getVertexIndex(2, index);
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
     res.axis = (p1-p0).cross(p2-p0).normalized();
     res.theta_o = 0.;
     res.theta_e = M_PI / 2;
@@ -200,10 +329,12 @@ LightCone Mesh::getLightCone() const  {
     }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
+    const MatrixXf &V = m_geometry->V;
+
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (V.col(getVertexIndex(0, index)) +
+         V.col(getVertexIndex(1, index)) +
+         V.col(getVertexIndex(2, index)));
 }
 
 
@@ -219,8 +350,8 @@ std::string Mesh::toString() const {
         "  exterior_medium = %s,\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        getVertexCount(),
+        getPrimitiveCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null"),
         m_interior ? indent(m_interior->toString()) : std::string("null"),
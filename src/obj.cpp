@@ -17,165 +17,558 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/registry.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
+#include <tbb/tbb.h>
+#include <sys/stat.h>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and split into chunks at line boundaries,
+ * which are parsed in parallel without per-line allocations. Vertices
+ * that share the same position/texture/normal indices are merged by a
+ * parallel sort; they are numbered in the order of their first use, so
+ * the result is the same as that of a sequential parser.
+ *
+ * The booleans "compactNormals", "compactTexCoords" and "compactIndices"
+ * (all defaulting to "compact", which is \c false) select the compact
+ * storage of \ref Mesh::Geometry::compact() for dense meshes.
+ *
+ * With "cache" set to \c true, the final buffers (transformed and, if
+ * requested, compacted) are written to a binary file beside the OBJ
+ * file, or into the directory given by "cacheDirectory". Later runs map
+ * that file instead of parsing the OBJ file, as long as the size and
+ * modification time of the source, the transform and the layout match.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
+        m_name = filename.str();
+
+        bool compact = propList.getBoolean("compact", false);
+        bool compactNormals = propList.getBoolean("compactNormals", compact);
+        bool compactTexCoords = propList.getBoolean("compactTexCoords", compact);
+        bool compactIndices = propList.getBoolean("compactIndices", compact);
+
+        /* Share the buffers of an earlier mesh loaded from the same file with the same transform and layout */
+        const Eigen::Matrix4f &matrix = trafo.getMatrix();
+        std::string key = filename.str() + std::string((const char *) matrix.data(), sizeof(float) * 16) +
+            (compactNormals ? "n" : "") + (compactTexCoords ? "t" : "") + (compactIndices ? "i" : "");
+        if (std::shared_ptr<Geometry> geometry = GeometryRegistry::get().findGeometry(key)) {
+            m_geometry = geometry;
+            for (uint32_t i = 0; i < getVertexCount(); ++i)
+                m_bbox.expandBy(Point3f(m_geometry->V.col(i)));
+            cout << "Sharing \"" << filename << "\" with an earlier mesh (V="
+                << m_geometry->V.cols() << ", F=" << m_geometry->getFaceCount() << ")" << endl;
+            return;
+        }
+
+        /* Look for a binary copy written by an earlier run */
+        std::string cacheFile;
+        uint64_t cacheKey = 0;
+        if (propList.getBoolean("cache", false)) {
+            struct stat info;
+            if (stat(filename.str().c_str(), &info) != 0)
+                throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+
+            cacheKey = hashValue(OBJ_CACHE_VERSION);
+            cacheKey = hashBytes(key.data(), key.size(), cacheKey);
+            cacheKey = hashValue((uint64_t) info.st_size, cacheKey);
+            cacheKey = hashValue((int64_t) info.st_mtime, cacheKey);
+
+            std::ostringstream name;
+            name << filename.filename() << "." << std::hex << std::setw(16) << std::setfill('0')
+                 << cacheKey << ".mesh";
+            std::string directory = propList.getString("cacheDirectory", "");
+            if (directory.empty()) {
+                cacheFile = (filename.parent_path() / filesystem::path(name.str())).str();
+            } else {
+                filesystem::path path(directory);
+                if (!path.exists())
+                    filesystem::create_directory(path);
+                cacheFile = (path / filesystem::path(name.str())).str();
+            }
+
+            Timer timer;
+            if (loadCache(cacheFile, cacheKey)) {
+                m_geometry = GeometryRegistry::get().addGeometry(key, m_geometry);
+                cout << "Loading \"" << filename << "\" from \"" << cacheFile << "\" .. done. (V="
+                    << m_geometry->V.cols() << ", F=" << m_geometry->getFaceCount() << ", took "
+                    << timer.elapsedString() << " and " << memString(m_geometry->getMemoryUsage())
+                    << ")" << endl;
+                return;
+            }
+        }
+
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+        }
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
+        /* Parse chunks of about 1 MiB that end at line breaks */
+        const char *data = (const char *) file->data(), *end = data + file->size();
+        std::vector<const char *> bounds(1, data);
+        const size_t chunkSize = 1 << 20;
+        while (bounds.back() != end) {
+            const char *next = bounds.back() + std::min(chunkSize, (size_t) (end - bounds.back()));
+            while (next != end && next[-1] != '\n')
+                ++next;
+            bounds.push_back(next);
+        }
 
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
+        std::vector<OBJChunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            parseChunk(bounds[i], bounds[i + 1], trafo, chunks[i]);
+        });
+
+        std::vector<Vector3f> positions, normals;
+        std::vector<Vector2f> texcoords;
+        std::vector<OBJVertex> corners;
+        concatenate(chunks, &OBJChunk::positions, positions);
+        concatenate(chunks, &OBJChunk::normals, normals);
+        concatenate(chunks, &OBJChunk::texcoords, texcoords);
+        concatenate(chunks, &OBJChunk::corners, corners);
+        for (const OBJChunk &chunk : chunks)
+            m_bbox.expandBy(chunk.bbox);
+        chunks.clear();
+
+        std::vector<uint32_t> indices;
+        std::vector<OBJVertex> vertices;
+        deduplicate(corners, indices, vertices);
+
+        m_geometry->F.resize(3, indices.size()/3);
+        memcpy(m_geometry->F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+
+        uint32_t vertexCount = (uint32_t) vertices.size();
+        m_geometry->V.resize(3, vertexCount);
+        if (!normals.empty())
+            m_geometry->N.resize(3, vertexCount);
+        if (!texcoords.empty())
+            m_geometry->UV.resize(2, vertexCount);
+
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, vertexCount, 4096),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = vertices[i];
+                    m_geometry->V.col(i) = lookup(positions, v.p, "position", filename);
+                    if (!normals.empty())
+                        m_geometry->N.col(i) = lookup(normals, v.n, "normal", filename);
+                    if (!texcoords.empty())
+                        m_geometry->UV.col(i) = lookup(texcoords, v.uv, "texture coordinate", filename);
                 }
             }
+        );
+
+        if (m_geometry->getMemoryUsage() == 0) {
+            cout << endl;
+            throw NoriException("OBJ file \"%s\" contains no data! Make sure you have Git LFS installed", filename);
         }
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        size_t saved = m_geometry->compact(compactNormals, compactTexCoords, compactIndices);
+        size_t meshSize = m_geometry->getMemoryUsage();
+
+        m_geometry = GeometryRegistry::get().addGeometry(key, m_geometry);
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+        cout << "done. (V=" << m_geometry->V.cols() << ", F=" << m_geometry->getFaceCount() << ", took "
+            << timer.elapsedString() << " and "
+            << memString(meshSize);
+        if (saved > 0)
+            cout << ", " << memString(saved) << " saved by the compact layout";
+        cout << ")" << endl;
+
+        if (!cacheFile.empty())
+            saveCache(cacheFile, cacheKey);
+    }
+
+protected:
+    /// Layout of the cache files: header, then the buffers in the order of \c cols
+    struct OBJCacheHeader {
+        char magic[8];        ///< "NORIOBJ"
+        uint32_t version;     ///< Bumped whenever the layout of \ref Mesh::Geometry changes
+        uint32_t padding;
+        uint64_t key;         ///< Hash of the source, its size and time stamp, transform and layout
+        uint64_t cols[7];     ///< Columns of V, N, UV, F, Noct, UVh and F16
+        float bbox[6];        ///< Bounding box of V
+    };
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+    /// Number of rows and bytes per entry of the cached buffers
+    static const int CACHE_ROWS[7];
+    static const size_t CACHE_SIZES[7];
+
+    /// Return the data of the cached buffers, after resizing them to \c cols if given
+    void cacheBuffers(uint8_t *data[7], const uint64_t *cols = nullptr) {
+        Geometry &g = *m_geometry;
+        if (cols) {
+            g.V.resize(CACHE_ROWS[0], cols[0]);
+            g.N.resize(CACHE_ROWS[1], cols[1]);
+            g.UV.resize(CACHE_ROWS[2], cols[2]);
+            g.F.resize(CACHE_ROWS[3], cols[3]);
+            g.Noct.resize(CACHE_ROWS[4], cols[4]);
+            g.UVh.resize(CACHE_ROWS[5], cols[5]);
+            g.F16.resize(CACHE_ROWS[6], cols[6]);
         }
+        data[0] = (uint8_t *) g.V.data();
+        data[1] = (uint8_t *) g.N.data();
+        data[2] = (uint8_t *) g.UV.data();
+        data[3] = (uint8_t *) g.F.data();
+        data[4] = (uint8_t *) g.Noct.data();
+        data[5] = (uint8_t *) g.UVh.data();
+        data[6] = (uint8_t *) g.F16.data();
+    }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+    /// Try to fill \ref m_geometry and \ref m_bbox from a cache file
+    bool loadCache(const std::string &filename, uint64_t key) {
+        if (!filesystem::path(filename).exists())
+            return false;
+        try {
+            MemoryMappedFile file(filename);
+            if (file.size() < sizeof(OBJCacheHeader))
+                return false;
+
+            OBJCacheHeader header;
+            memcpy(&header, file.data(), sizeof(OBJCacheHeader));
+            if (memcmp(header.magic, OBJ_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version != OBJ_CACHE_VERSION || header.key != key)
+                return false;
+
+            size_t expected = sizeof(OBJCacheHeader);
+            for (int i = 0; i < 7; ++i)
+                expected += header.cols[i] * CACHE_ROWS[i] * CACHE_SIZES[i];
+            if (file.size() != expected)
+                return false;
+
+            uint8_t *data[7];
+            cacheBuffers(data, header.cols);
+            const uint8_t *ptr = file.data() + sizeof(OBJCacheHeader);
+            for (int i = 0; i < 7; ++i) {
+                size_t size = header.cols[i] * CACHE_ROWS[i] * CACHE_SIZES[i];
+                memcpy(data[i], ptr, size);
+                ptr += size;
+            }
+            m_bbox = BoundingBox3f(Point3f(header.bbox[0], header.bbox[1], header.bbox[2]),
+                                   Point3f(header.bbox[3], header.bbox[4], header.bbox[5]));
+        } catch (const NoriException &e) {
+            cerr << "Warning: could not read mesh cache: " << e.what() << endl;
+            m_geometry = std::make_shared<Geometry>();
+            return false;
         }
+        return true;
+    }
 
-        size_t meshSize = m_F.size() * sizeof(uint32_t) +
-            sizeof(float) * (m_V.size() + m_N.size() + m_UV.size());
+    /// Write \ref m_geometry and \ref m_bbox to a cache file
+    void saveCache(const std::string &filename, uint64_t key) {
+        OBJCacheHeader header;
+        memset(&header, 0, sizeof(OBJCacheHeader));
+        memcpy(header.magic, OBJ_CACHE_MAGIC, sizeof(header.magic));
+        header.version = OBJ_CACHE_VERSION;
+        header.key = key;
+        const Geometry &g = *m_geometry;
+        header.cols[0] = g.V.cols();
+        header.cols[1] = g.N.cols();
+        header.cols[2] = g.UV.cols();
+        header.cols[3] = g.F.cols();
+        header.cols[4] = g.Noct.cols();
+        header.cols[5] = g.UVh.cols();
+        header.cols[6] = g.F16.cols();
+        for (int i = 0; i < 3; ++i) {
+            header.bbox[i] = m_bbox.min[i];
+            header.bbox[i + 3] = m_bbox.max[i];
+        }
 
-        if (meshSize == 0) {
-            cout << endl;
-            throw NoriException("OBJ file \"%s\" contains no data! Make sure you have Git LFS installed", filename);
+        uint8_t *data[7];
+        cacheBuffers(data);
+
+        /* Write to a temporary file first, so that concurrent renders
+           never map a partially written cache entry */
+        std::ostringstream tempName;
+        tempName << filename << "." << std::hex << (uintptr_t) this << ".tmp";
+        {
+            std::ofstream os(tempName.str(), std::ios::binary);
+            os.write((const char *) &header, sizeof(OBJCacheHeader));
+            for (int i = 0; i < 7; ++i)
+                os.write((const char *) data[i], header.cols[i] * CACHE_ROWS[i] * CACHE_SIZES[i]);
+            if (!os) {
+                cerr << "Warning: could not write mesh cache \"" << tempName.str() << "\"" << endl;
+                std::remove(tempName.str().c_str());
+                return;
+            }
         }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-            << timer.elapsedString() << " and "
-            << memString(meshSize)
-            << ")" << endl;
+        if (std::rename(tempName.str().c_str(), filename.c_str()) != 0) {
+            /* Windows does not replace existing files */
+            std::remove(filename.c_str());
+            if (std::rename(tempName.str().c_str(), filename.c_str()) != 0) {
+                cerr << "Warning: could not write mesh cache \"" << filename << "\"" << endl;
+                std::remove(tempName.str().c_str());
+            }
+        }
     }
 
-protected:
+    static constexpr char OBJ_CACHE_MAGIC[8] = "NORIOBJ";
+    static constexpr uint32_t OBJ_CACHE_VERSION = 1;
+
     /// Vertex indices used by the OBJ format
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
         uint32_t n = (uint32_t) -1;
         uint32_t uv = (uint32_t) -1;
 
-        inline OBJVertex() { }
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
+    };
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+    /// Data parsed from one chunk of the file, in file order
+    struct OBJChunk {
+        std::vector<Vector3f> positions;   ///< Transformed positions
+        std::vector<Vector3f> normals;     ///< Transformed normals
+        std::vector<Vector2f> texcoords;
+        std::vector<OBJVertex> corners;    ///< Three per triangle (quads are split)
+        BoundingBox3f bbox;                ///< Bounds of \c positions
+    };
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
 
-            p = toUInt(tokens[0]);
+    static const char *skipSpace(const char *ptr, const char *end) {
+        while (ptr != end && isSpace(*ptr))
+            ++ptr;
+        return ptr;
+    }
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+    /// Parse the next floating point value on the line (0 if there is none)
+    static float parseFloat(const char *&ptr, const char *end) {
+        ptr = skipSpace(ptr, end);
+        if (ptr != end && *ptr == '+')
+            ++ptr;
+        float value = 0.f;
+        std::from_chars_result result = std::from_chars(ptr, end, value);
+        if (result.ec == std::errc::result_out_of_range) {
+            /* Denormals and overflow: round like the stream library does */
+            char buffer[64];
+            size_t length = std::min((size_t) (result.ptr - ptr), sizeof(buffer) - 1);
+            memcpy(buffer, ptr, length);
+            buffer[length] = '\0';
+            value = std::strtof(buffer, nullptr);
+        }
+        if (result.ec != std::errc::invalid_argument)
+            ptr = result.ptr;
+        return value;
+    }
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+    /// Parse a face vertex of the form p, p/uv, p//n or p/uv/n
+    static OBJVertex parseVertex(const char *begin, const char *end) {
+        OBJVertex v;
+        uint32_t *fields[3] = { &v.p, &v.uv, &v.n };
+        const char *ptr = begin;
+        for (int i = 0; ; ++i) {
+            if (ptr != end && *ptr != '/') {
+                std::from_chars_result result = std::from_chars(ptr, end, *fields[i]);
+                if (result.ec != std::errc() || (result.ptr != end && *result.ptr != '/'))
+                    throw NoriException("Invalid vertex data: \"%s\"", std::string(begin, end));
+                ptr = result.ptr;
+            } else if (i == 0) {
+                throw NoriException("Invalid vertex data: \"%s\"", std::string(begin, end));
+            }
+            if (ptr == end)
+                break;
+            if (i == 2)
+                throw NoriException("Invalid vertex data: \"%s\"", std::string(begin, end));
+            ++ptr; /* Skip the '/' */
         }
+        return v;
+    }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+    static void parseChunk(const char *ptr, const char *end, const Transform &trafo, OBJChunk &chunk) {
+        while (ptr != end) {
+            const char *lineEnd = (const char *) memchr(ptr, '\n', end - ptr);
+            if (!lineEnd)
+                lineEnd = end;
+
+            const char *token = skipSpace(ptr, lineEnd), *tokenEnd = token;
+            while (tokenEnd != lineEnd && !isSpace(*tokenEnd))
+                ++tokenEnd;
+            size_t length = tokenEnd - token;
+            const char *cur = tokenEnd;
+
+            if (length == 1 && token[0] == 'v') {
+                Point3f p;
+                p.x() = parseFloat(cur, lineEnd);
+                p.y() = parseFloat(cur, lineEnd);
+                p.z() = parseFloat(cur, lineEnd);
+                p = trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (length == 2 && token[0] == 'v' && token[1] == 't') {
+                Point2f tc;
+                tc.x() = parseFloat(cur, lineEnd);
+                tc.y() = parseFloat(cur, lineEnd);
+                chunk.texcoords.push_back(tc);
+            } else if (length == 2 && token[0] == 'v' && token[1] == 'n') {
+                Normal3f n;
+                n.x() = parseFloat(cur, lineEnd);
+                n.y() = parseFloat(cur, lineEnd);
+                n.z() = parseFloat(cur, lineEnd);
+                chunk.normals.push_back((trafo * n).normalized());
+            } else if (length == 1 && token[0] == 'f') {
+                /* Like the previous stream-based parser, this only looks at the first four vertices */
+                OBJVertex verts[4];
+                int nVertices = 0;
+                while (nVertices < 4) {
+                    const char *begin = skipSpace(cur, lineEnd);
+                    if (begin == lineEnd)
+                        break;
+                    cur = begin;
+                    while (cur != lineEnd && !isSpace(*cur))
+                        ++cur;
+                    verts[nVertices++] = parseVertex(begin, cur);
+                }
+                if (nVertices < 3)
+                    throw NoriException("Invalid face: \"%s\"", std::string(ptr, lineEnd));
+
+                chunk.corners.push_back(verts[0]);
+                chunk.corners.push_back(verts[1]);
+                chunk.corners.push_back(verts[2]);
+                if (nVertices == 4) {
+                    /* This is a quad, split into two triangles */
+                    chunk.corners.push_back(verts[3]);
+                    chunk.corners.push_back(verts[0]);
+                    chunk.corners.push_back(verts[2]);
+                }
+            }
+
+            ptr = lineEnd == end ? end : lineEnd + 1;
         }
-    };
+    }
+
+    /// Concatenate one array of all chunks in parallel
+    template <typename T>
+    static void concatenate(std::vector<OBJChunk> &chunks, std::vector<T> OBJChunk::*member,
+                            std::vector<T> &result) {
+        std::vector<size_t> offsets(chunks.size() + 1, 0);
+        for (size_t i = 0; i < chunks.size(); ++i)
+            offsets[i + 1] = offsets[i] + (chunks[i].*member).size();
+        result.resize(offsets.back());
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            std::vector<T> &values = chunks[i].*member;
+            std::copy(values.begin(), values.end(), result.begin() + offsets[i]);
+            std::vector<T>().swap(values);
+        });
+    }
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex& v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+    /**
+     * \brief Merge identical face vertices
+     *
+     * Sorts the corners by their indices (and position in the face list),
+     * so that the first corner of every run is the first use of a vertex.
+     * Numbering these first uses in file order reproduces the indices of
+     * a sequential hash map based implementation.
+     */
+    static void deduplicate(const std::vector<OBJVertex> &corners, std::vector<uint32_t> &indices,
+                            std::vector<OBJVertex> &vertices) {
+        struct Corner {
+            OBJVertex v;
+            uint32_t index;
+
+            bool operator<(const Corner &c) const {
+                if (v.p != c.v.p) return v.p < c.v.p;
+                if (v.uv != c.v.uv) return v.uv < c.v.uv;
+                if (v.n != c.v.n) return v.n < c.v.n;
+                return index < c.index;
+            }
+        };
+
+        if (corners.size() > (size_t) std::numeric_limits<uint32_t>::max())
+            throw NoriException("OBJ file has too many face vertices!");
+        uint32_t size = (uint32_t) corners.size();
+        const uint32_t grainSize = 16384;
+
+        std::vector<Corner> sorted(size);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, grainSize),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    sorted[i] = Corner { corners[i], i };
+            }
+        );
+        tbb::parallel_sort(sorted.begin(), sorted.end());
+
+        /* Mark the first use of every vertex, then number them in file order */
+        std::vector<uint32_t> first(size, 0);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, grainSize),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    if (i == 0 || !(sorted[i].v == sorted[i - 1].v))
+                        first[sorted[i].index] = 1;
+            }
+        );
+        uint32_t vertexCount = 0;
+        for (uint32_t i = 0; i < size; ++i) {
+            uint32_t isFirst = first[i];
+            first[i] = vertexCount;
+            vertexCount += isFirst;
         }
-    };
+
+        /* Every corner takes the number of the first use in its run */
+        indices.resize(size);
+        vertices.resize(vertexCount);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, grainSize),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                uint32_t start = range.begin();
+                while (start > 0 && sorted[start - 1].v == sorted[range.begin()].v)
+                    --start;
+                uint32_t vertex = first[sorted[start].index];
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    if (!(sorted[i].v == sorted[start].v)) {
+                        start = i;
+                        vertex = first[sorted[i].index];
+                        vertices[vertex] = sorted[i].v;
+                    } else if (i == start) {
+                        vertices[vertex] = sorted[i].v;
+                    }
+                    indices[sorted[i].index] = vertex;
+                }
+            }
+        );
+    }
+
+    /// Look up a 1-based OBJ index
+    template <typename T>
+    static const T &lookup(const std::vector<T> &values, uint32_t index, const char *what,
+                           const filesystem::path &filename) {
+        if (index == 0 || index > values.size())
+            throw NoriException("OBJ file \"%s\": %s index %i is out of range!", filename, what, (int) index);
+        return values[index - 1];
+    }
+};
+
+const int WavefrontOBJ::CACHE_ROWS[7] = { 3, 3, 2, 3, 2, 2, 3 };
+const size_t WavefrontOBJ::CACHE_SIZES[7] = {
+    sizeof(float), sizeof(float), sizeof(float), sizeof(uint32_t),
+    sizeof(int16_t), sizeof(Eigen::half), sizeof(uint16_t)
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -18,13 +18,103 @@
 
 #include <nori/parser.h>
 #include <nori/proplist.h>
+#include <nori/timer.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/tbb.h>
+#include <atomic>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <streambuf>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Stream buffer that keeps the output of concurrently loaded objects apart
+ *
+ * While installed in \c cout, everything a thread prints goes to the
+ * string selected with \ref Capture (if any), so that the messages of
+ * every object can be printed in document order afterwards. Output
+ * outside of a capture is passed through.
+ */
+class LoaderOutputBuffer : public std::streambuf {
+public:
+    LoaderOutputBuffer(std::streambuf *target) : m_target(target) { }
+
+    /// Redirect the output of the current thread to \c output for the lifetime of this object
+    class Capture {
+    public:
+        Capture(std::string *output) : m_previous(t_output) { t_output = output; }
+        ~Capture() { t_output = m_previous; }
+    private:
+        std::string *m_previous;
+    };
+
+    /// Write \c text to the target buffer
+    void passThrough(const std::string &text) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_target->sputn(text.data(), (std::streamsize) text.size());
+        m_target->pubsync();
+    }
+
+protected:
+    virtual int overflow(int c) override {
+        if (c == traits_type::eof())
+            return traits_type::not_eof(c);
+        char ch = (char) c;
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    virtual std::streamsize xsputn(const char *s, std::streamsize n) override {
+        if (t_output) {
+            t_output->append(s, (size_t) n);
+            return n;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_target->sputn(s, n);
+    }
+
+    virtual int sync() override {
+        if (t_output)
+            return 0;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_target->pubsync();
+    }
+
+private:
+    std::streambuf *m_target;
+    std::mutex m_mutex;
+    static thread_local std::string *t_output;
+};
+
+thread_local std::string *LoaderOutputBuffer::t_output = nullptr;
+
+/// An object of the XML file whose properties have been parsed, but which has not been instantiated yet
+struct PendingObject {
+    pugi::xml_node node;
+    PropertyList propList;
+    std::vector<std::unique_ptr<PendingObject>> children;
+
+    NoriObject *result = nullptr;
+    std::string output;                  ///< Messages printed while loading this object
+    std::atomic<bool> done { false };    ///< Has the object been activated?
+    double constructionTime = 0;         ///< Time spent in the constructor (ms)
+    double activationTime = 0;           ///< Time spent in addChild() and activate() (ms)
+    double criticalPath = 0;             ///< Longest chain of dependent work ending here (ms)
+    const PendingObject *criticalChild = nullptr;
+
+    /// Short description for the load statistics
+    std::string describe() const {
+        std::string result = tfm::format("%s \"%s\"", node.name(), node.attribute("type").value());
+        if (propList.has("filename"))
+            result += tfm::format(" (%s)", propList.getString("filename"));
+        return result;
+    }
+};
+
 NoriObject *loadFromXML(const std::string &filename) {
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
@@ -135,9 +225,10 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
-    /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    /* Helper function to parse a Nori XML node (recursive). Objects are only
+       recorded here and instantiated by 'build' below */
+    std::function<PendingObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag) -> PendingObject * {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
             return nullptr;
@@ -179,45 +270,18 @@ NoriObject *loadFromXML(const std::string &filename) {
         else if (tag == ETransform)
             transform.setIdentity();
 
-        PropertyList propList;
-        std::vector<NoriObject *> children;
+        std::unique_ptr<PendingObject> result(new PendingObject());
+        result->node = node;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
+            PendingObject *child = parseTag(ch, result->propList, tag);
             if (child)
-                children.push_back(child);
+                result->children.emplace_back(child);
         }
 
-        NoriObject *result = nullptr;
         try {
             if (currentIsObject) {
                 //check_attributes(node, { "type" });
-
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
-                }
-
-                // set the name to help parent decide what to do with this node
-                result->setIdName(node.attribute("name").value());
-
-                /* Add all children */
-                for (auto ch: children) {
-                    result->addChild(ch);
-                    ch->setParent(result);
-                }
-
-                /* Activate / configure the object */
-                result->activate();
+                return result.release();
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -334,11 +398,147 @@ NoriObject *loadFromXML(const std::string &filename) {
                                 e.what(), offset(node.offset_debug()));
         }
 
-        return result;
+        return nullptr;
     };
 
     PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    std::unique_ptr<PendingObject> root(parseTag(*doc.begin(), list, EInvalid));
+
+    /* Messages are printed in the order of the serial loader: children before their parent */
+    std::vector<PendingObject *> order;
+    std::function<void(PendingObject &)> collect = [&](PendingObject &object) {
+        for (auto &child : object.children)
+            collect(*child);
+        order.push_back(&object);
+    };
+    collect(*root);
+
+    LoaderOutputBuffer buffer(cout.rdbuf());
+    struct RestoreOutput {
+        std::streambuf *previous;
+        ~RestoreOutput() { cout.rdbuf(previous); }
+    } restoreOutput { cout.rdbuf(&buffer) };
+
+    std::mutex flushMutex;
+    size_t flushed = 0;
+    auto flush = [&]() {
+        std::lock_guard<std::mutex> lock(flushMutex);
+        while (flushed < order.size() && order[flushed]->done) {
+            buffer.passThrough(order[flushed]->output);
+            order[flushed]->output.clear();
+            ++flushed;
+        }
+    };
+
+    auto instantiate = [&](PendingObject &object) {
+        pugi::xml_node &node = object.node;
+        int tag = tags.at(node.name());
+
+        /* This is an object, first instantiate it */
+        NoriObject *result = NoriObjectFactory::createInstance(
+            node.attribute("type").value(),
+            object.propList
+        );
+        object.result = result;
+
+        if (result->getClassType() != (int) tag) {
+            throw NoriException(
+                "Unexpectedly constructed an object "
+                "of type <%s> (expected type <%s>): %s",
+                NoriObject::classTypeName(result->getClassType()),
+                NoriObject::classTypeName((NoriObject::EClassType) tag),
+                result->toString());
+        }
+
+        // set the name to help parent decide what to do with this node
+        result->setIdName(node.attribute("name").value());
+    };
+
+    auto attach = [&](PendingObject &object) {
+        /* Add all children */
+        for (auto &ch: object.children) {
+            object.result->addChild(ch->result);
+            ch->result->setParent(object.result);
+        }
+
+        /* Activate / configure the object */
+        object.result->activate();
+    };
+
+    /* Instantiate every object as a separate task, concurrently with its
+       children. Once these are done, they are added in document order
+       and the object is activated */
+    std::function<void(PendingObject &)> build = [&](PendingObject &object) {
+        tbb::task_group group;
+        for (auto &child : object.children) {
+            PendingObject *ch = child.get();
+            group.run([&build, ch] { build(*ch); });
+        }
+
+        std::exception_ptr error;
+        try {
+            LoaderOutputBuffer::Capture capture(&object.output);
+            Timer timer;
+            instantiate(object);
+            object.constructionTime = timer.elapsed();
+        } catch (const NoriException &e) {
+            error = std::make_exception_ptr(NoriException(
+                "Error while parsing \"%s\": %s (at %s)", filename,
+                e.what(), offset(object.node.offset_debug())));
+        } catch (...) {
+            error = std::current_exception();
+        }
+        group.wait();
+        if (error)
+            std::rethrow_exception(error);
+
+        /* The root object is last in the output order, so it can print directly */
+        bool isRoot = &object == root.get();
+        if (isRoot) {
+            flush();
+            buffer.passThrough(object.output);
+            object.output.clear();
+        }
+
+        try {
+            LoaderOutputBuffer::Capture capture(isRoot ? nullptr : &object.output);
+            Timer timer;
+            attach(object);
+            object.activationTime = timer.elapsed();
+        } catch (const NoriException &e) {
+            throw NoriException("Error while parsing \"%s\": %s (at %s)", filename,
+                                e.what(), offset(object.node.offset_debug()));
+        }
+
+        object.criticalPath = object.constructionTime;
+        for (auto &child : object.children) {
+            if (child->criticalPath > object.criticalPath) {
+                object.criticalPath = child->criticalPath;
+                object.criticalChild = child.get();
+            }
+        }
+        object.criticalPath += object.activationTime;
+
+        object.done = true;
+        if (!isRoot)
+            flush();
+    };
+
+    Timer timer;
+    build(*root);
+
+    double work = 0;
+    for (const PendingObject *object : order)
+        work += object->constructionTime + object->activationTime;
+    std::string path;
+    for (const PendingObject *object = root.get(); object; object = object->criticalChild)
+        path += (path.empty() ? "" : " > ") + object->describe();
+
+    cout << "Loaded " << order.size() << " objects (took " << timer.elapsedString() << ", "
+        << timeString(work) << " of work, critical path of " << timeString(root->criticalPath)
+        << ": " << path << ")." << endl;
+
+    return root->result;
 }
 
 NORI_NAMESPACE_END
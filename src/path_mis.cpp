@@ -54,7 +54,7 @@ public:
                 const Vector3f wo = its.shFrame.toLocal(-ray.d);
                 const Vector3f wi = its.shFrame.toLocal(eqr2.shadowRay.d);
 
-                if (!scene->rayIntersect(eqr2.shadowRay)) {
+                if (!scene->occluded(eqr2.shadowRay)) {
                     //sample bsdf
                     BSDFQueryRecord bqr2 = BSDFQueryRecord(wo, wi, ESolidAngle);
                     bqr2.its = &its;
@@ -107,7 +107,7 @@ public:
                 const Vector3f wo2 = its.shFrame.toLocal(-ray.d);
                 const Vector3f wi2 = its.shFrame.toLocal(eqr2.shadowRay.d);
 
-                if (!scene->rayIntersect(eqr2.shadowRay)) {
+                if (!scene->occluded(eqr2.shadowRay)) {
                     //sample bsdf
                     BSDFQueryRecord bqr2 = BSDFQueryRecord(wo2, wi2, ESolidAngle);
                     bqr2.its = &its;
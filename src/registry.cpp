@@ -0,0 +1,190 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/registry.h>
+#include <nori/timer.h>
+#include <tbb/tbb.h>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Mesh that a shared BVH is built over. It holds its own reference to the
+ * geometry, so the BVH stays valid when one of the sharing meshes copies
+ * its geometry on write (see \ref Mesh::setVertexPositions()). That
+ * reference is marked as such, so that a mesh that is the last one using
+ * the geometry still changes it in place.
+ */
+class SharedMesh : public Mesh {
+public:
+    SharedMesh(const Mesh *mesh) {
+        m_name = mesh->getName();
+        m_geometry = mesh->getGeometry();
+        m_geometry->bvhReferences++;
+        m_bbox = static_cast<const Shape *>(mesh)->getBoundingBox();
+    }
+
+    virtual ~SharedMesh() {
+        m_geometry->bvhReferences--;
+    }
+};
+
+GeometryRegistry &GeometryRegistry::get() {
+    static GeometryRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<Mesh::Geometry> GeometryRegistry::findGeometry(const std::string &key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_geometry.find(key);
+    if (it == m_geometry.end())
+        return nullptr;
+    return it->second.lock();
+}
+
+std::shared_ptr<Mesh::Geometry> GeometryRegistry::addGeometry(const std::string &key,
+        const std::shared_ptr<Mesh::Geometry> &geometry) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::weak_ptr<Mesh::Geometry> &entry = m_geometry[key];
+    if (std::shared_ptr<Mesh::Geometry> existing = entry.lock())
+        return existing;
+    entry = geometry;
+    return geometry;
+}
+
+std::shared_ptr<BVH> GeometryRegistry::acquireBVH(Shape *shape, const std::string &settings,
+                                                  const std::function<void(BVH *)> &configure) {
+    /* Meshes are identified by their (possibly shared) buffers, other shapes by themselves */
+    const Mesh *mesh = dynamic_cast<const Mesh *>(shape);
+    const void *id = shape;
+    if (mesh)
+        id = mesh->getGeometry().get();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requests++;
+
+    BVHKey key(id, settings);
+    auto it = m_bvhs.find(key);
+    if (it != m_bvhs.end()) {
+        if (std::shared_ptr<BVH> bvh = it->second.lock())
+            return bvh;
+    }
+
+    std::shared_ptr<BVH> bvh = std::make_shared<BVH>();
+    configure(bvh.get());
+    if (mesh)
+        bvh->addShape(new SharedMesh(mesh));
+    else
+        bvh->addShape(shape);
+    m_bvhs[key] = bvh;
+    m_pending.push_back(bvh);
+    return bvh;
+}
+
+void GeometryRegistry::buildPending() {
+    std::vector<std::shared_ptr<BVH>> pending;
+    size_t requests;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pending.swap(m_pending);
+        requests = m_requests;
+        m_requests = 0;
+    }
+
+    if (pending.empty())
+        return;
+
+    if (pending.size() == 1) {
+        pending[0]->build();
+        return;
+    }
+
+    cout << "Building " << pending.size() << " distinct subscene BVHs (for "
+        << requests << " subscenes) concurrently:" << endl;
+    Timer timer;
+
+    /* Collect the messages of every build and print them in order afterwards */
+    std::vector<std::ostringstream> logs(pending.size());
+    tbb::parallel_for(size_t(0), pending.size(), [&](size_t i) {
+        pending[i]->setLog(&logs[i]);
+        pending[i]->build();
+        pending[i]->setLog(&cout);
+    });
+
+    for (size_t i = 0; i < pending.size(); ++i)
+        cout << "  " << indent(logs[i].str(), 2);
+    cout << "Subscene BVHs done (took " << timer.elapsedString() << ")." << endl;
+}
+
+TextureRegistry &TextureRegistry::get() {
+    static TextureRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<const TextureData> TextureRegistry::find(const Key &key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_textures.find(key);
+    if (it == m_textures.end())
+        return nullptr;
+    return it->second.lock();
+}
+
+std::shared_ptr<const TextureData> TextureRegistry::add(const Key &key,
+        const std::shared_ptr<const TextureData> &data) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::weak_ptr<const TextureData> &entry = m_textures[key];
+    if (std::shared_ptr<const TextureData> existing = entry.lock())
+        return existing;
+    entry = data;
+    return data;
+}
+
+void TextureRegistry::printSummary() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::ostringstream entries;
+    size_t images = 0, users = 0, memory = 0, saved = 0;
+    for (auto it = m_textures.begin(); it != m_textures.end(); ) {
+        std::shared_ptr<const TextureData> data = it->second.lock();
+        if (!data) {
+            it = m_textures.erase(it);
+            continue;
+        }
+
+        /* Not counting the reference held by 'data' */
+        size_t count = (size_t) data.use_count() - 1, size = data->getMemoryUsage();
+        images++;
+        users += count;
+        memory += size;
+        saved += (count - 1) * size;
+        entries << "  \"" << std::get<0>(it->first) << "\" (" << std::get<1>(it->first) << ", "
+            << std::get<2>(it->first) << "): " << data->toString() << ", used by " << count
+            << (count == 1 ? " texture, " : " textures, ") << memString(size) << endl;
+        ++it;
+    }
+
+    if (images == 0)
+        return;
+
+    cout << "Texture memory: " << images << (images == 1 ? " image" : " images")
+        << " for " << users << (users == 1 ? " texture" : " textures") << " ("
+        << memString(memory) << ", " << memString(saved) << " saved by sharing):" << endl
+        << entries.str();
+}
+
+NORI_NAMESPACE_END
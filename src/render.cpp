@@ -25,6 +25,7 @@
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
+#include <nori/texcache.h>
 #include <nori/gui.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
@@ -142,6 +143,11 @@ void RenderThread::renderScene(const std::string & filename) {
             /* Create a block generator (i.e. a work scheduler) */
             BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
 
+#if defined(NORI_BVH_COUNTERS)
+            BVH::resetCounters();
+#endif
+            TextureCache::get().resetStatistics();
+
             cout << "Rendering .. ";
             cout.flush();
             Timer timer;
@@ -151,6 +157,7 @@ void RenderThread::renderScene(const std::string & filename) {
 
             tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
             samplers.resize(numBlocks);
+            uint32_t samplesDone = 0;
 
             for (uint32_t k = 0; k < numSamples ; ++k) {
                 m_progress = k/float(numSamples);
@@ -191,10 +198,33 @@ void RenderThread::renderScene(const std::string & filename) {
                 tbb::parallel_for(range, map);
 
                 blockGenerator.reset();
+                ++samplesDone;
             }
 
+            double seconds = timer.elapsed() / 1000.0;
             cout << "done. (took " << timer.elapsedString() << ")" << endl;
 
+            /* Aggregate throughput of this render */
+            uint64_t cameraRays = (uint64_t) outputSize.x() * outputSize.y() * samplesDone;
+            cout << tfm::format("Render statistics: %u samples/pixel, %llu camera rays (%.2f M/s)",
+                samplesDone, (unsigned long long) cameraRays,
+                seconds > 0 ? cameraRays / seconds * 1e-6 : 0.0);
+#if defined(NORI_BVH_COUNTERS)
+            BVH::Counters counters = BVH::getCounters();
+            cout << tfm::format(", %llu traced rays (%.2f M/s, %.2f per camera ray)",
+                (unsigned long long) counters.rays,
+                seconds > 0 ? counters.rays / seconds * 1e-6 : 0.0,
+                cameraRays > 0 ? (double) counters.rays / cameraRays : 0.0);
+#endif
+            cout << endl;
+
+#if defined(NORI_BVH_COUNTERS)
+            cout << BVH::countersString() << endl;
+#endif
+            std::string textureStats = TextureCache::get().statisticsString();
+            if (!textureStats.empty())
+                cout << textureStats << endl;
+
             /* Now turn the rendered image block into
                a properly normalized bitmap */
             m_block.lock();
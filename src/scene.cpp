@@ -24,11 +24,31 @@
 #include <nori/emitter.h>
 #include <nori/subscene.h>
 #include <nori/instance.h>
+#include <nori/registry.h>
+#include <nori/texcache.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+Scene::Scene(const PropertyList &propList) {
     m_bvh = new BVH();
+    /* Branching factor of the traversal hierarchy (2, 4, or 8) */
+    m_bvh->setWidth(propList.getInteger("bvhWidth", 2));
+    /* Store triangles in leaf order for the intersection loop */
+    m_bvh->setPrecomputeTriangles(propList.getBoolean("bvhTriangles", false));
+    /* Triangles tested at a time (1, 4 or 8) and the leaf granularity the builders aim for (0: same) */
+    m_bvh->setTriangleWidth(propList.getInteger("bvhTriangleWidth", 1));
+    m_bvh->setLeafSize(propList.getInteger("bvhLeafSize", 0));
+    /* Construction algorithm ("sah", "sbvh", "lbvh" or "hlbvh") and the extra references spatial splits may add */
+    m_bvh->setBuilder(propList.getString("bvhBuilder", "sah"));
+    m_bvh->setSplitBudget(propList.getFloat("bvhSplitBudget", 0.5f));
+    /* Directory for cached hierarchies; empty disables the cache */
+    m_bvh->setCacheDirectory(propList.getString("bvhCache", ""));
+    /* Bits per quantized wide node bound (0, 8 or 16); 0 keeps full precision */
+    m_bvh->setCompression(propList.getInteger("bvhCompression", 0));
+    /* Bytes per treelet of wide nodes (e.g. 64 or 4096); 0 keeps depth-first order */
+    m_bvh->setTreeletSize(propList.getInteger("bvhTreeletSize", 0));
+    /* Memory for the resident tiles of tiled image textures (MiB) */
+    TextureCache::get().setBudget((size_t) propList.getInteger("textureCacheSize", 256) << 20);
     m_lbvh = new LightBVH();
 }
 
@@ -42,6 +62,8 @@ Scene::~Scene() {
 }
 
 void Scene::activate() {
+    /* Distinct subscene BVHs first (concurrently), then the top level */
+    GeometryRegistry::get().buildPending();
     m_bvh->build();
 
     if (!m_integrator)
@@ -58,11 +80,26 @@ void Scene::activate() {
     for (Emitter *emitter : m_emitters) m_lbvh->addEmitter(emitter);
     m_lbvh->build();
 
+    TextureRegistry::get().printSummary();
+
     cout << endl;
     cout << "Configuration: " << toString() << endl;
     cout << endl;
 }
 
+void Scene::update(bool rebuild) {
+    /* Instance bounds depend on the (possibly refit) subscenes */
+    for (Shape *shape : m_shapes) {
+        if (shape->getClassType() == EInstance)
+            static_cast<Instance *>(shape)->updateBoundingBox();
+    }
+
+    if (rebuild)
+        m_bvh->rebuild();
+    else
+        m_bvh->refit();
+}
+
 void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case ESubScene: {
@@ -91,8 +128,7 @@ void Scene::addChild(NoriObject *obj) {
                 Shape *mesh = static_cast<Shape *>(obj);
                 m_bvh->addShape(mesh);
                 m_shapes.push_back(mesh);
-                if(mesh->isEmitter())
-                    m_emitters.push_back(mesh->getEmitter());
+                mesh->getEmitters(m_emitters);
             }
             break;
         
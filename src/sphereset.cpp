@@ -0,0 +1,416 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sphere.h>
+#include <nori/bsdf.h>
+#include <nori/emitter.h>
+#include <nori/dpdf.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <filesystem/resolver.h>
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define NORI_SPHERESET_SSE 1
+#  include <immintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Many analytic spheres in a single shape
+ *
+ * Replaces a long list of <tt>&lt;mesh type="sphere"&gt;</tt> objects,
+ * which would otherwise each be a separate BVH primitive with its own
+ * virtual calls. Spheres can be given in two ways:
+ *
+ * - as nested <tt>&lt;mesh type="sphere"&gt;</tt> children, which keep
+ *   their own BSDF, emitter and media. Hits on them report the nested
+ *   sphere as \c its.mesh, so integrators and the light hierarchy treat
+ *   them exactly like standalone spheres.
+ * - through a text file ("filename") with one <tt>x y z radius</tt> line
+ *   per sphere ('#' starts a comment). These use the BSDF, emitter and
+ *   media of the sphere set itself.
+ *
+ * Centers and squared radii are stored in clusters of four (SoA within
+ * a cluster), grouped by median splits so that the clusters stay
+ * compact. Each cluster is one BVH primitive and is intersected with a
+ * single 4-wide quadratic solve.
+ */
+class SphereSet : public Shape {
+public:
+    SphereSet(const PropertyList &propList) {
+        if (propList.has("filename")) {
+            filesystem::path filename =
+                getFileResolver()->resolve(propList.getString("filename"));
+            loadSpheres(filename);
+        }
+    }
+
+    virtual ~SphereSet() {
+        for (Sphere *sphere : m_children)
+            delete sphere;
+    }
+
+    virtual void addChild(NoriObject *obj) override {
+        if (obj->getClassType() != EMesh) {
+            Shape::addChild(obj);
+            return;
+        }
+
+        Sphere *sphere = dynamic_cast<Sphere *>(obj);
+        if (!sphere)
+            throw NoriException("SphereSet::addChild(): only spheres can be nested!");
+        m_children.push_back(sphere);
+        addSphere(sphere->getCenter(), sphere->getRadius(), sphere);
+    }
+
+    virtual void activate() override {
+        if (m_centers.empty())
+            throw NoriException("SphereSet: no spheres were specified!");
+
+        Shape::activate();
+        buildClusters();
+
+        /* An emitter on the set covers the spheres it owns, proportionally to their area */
+        if (m_emitter) {
+            m_pdf.clear();
+            m_pdf.reserve(m_centers.size());
+            for (size_t i = 0; i < m_centers.size(); ++i)
+                m_pdf.append(m_owners[i] == this ? 4 * M_PI * m_radii[i] * m_radii[i] : 0.f);
+            if (m_pdf.normalize() == 0)
+                throw NoriException("SphereSet: the emitter of the set does not cover any sphere "
+                                    "(nested spheres need emitters of their own)!");
+        }
+    }
+
+    virtual void getEmitters(std::vector<Emitter *> &emitters) override {
+        Shape::getEmitters(emitters);
+        for (Sphere *sphere : m_children)
+            sphere->getEmitters(emitters);
+    }
+
+    virtual uint32_t getPrimitiveCount() const override { return (uint32_t) m_clusters.size(); }
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_clusterBounds[index]; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_clusterBounds[index].getCenter(); }
+
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override {
+        uint32_t hitIndex;
+        return rayIntersectDeferred(index, ray, u, v, t, hitIndex);
+    }
+
+    virtual bool rayIntersectDeferred(uint32_t index, const Ray3f &ray, float &u, float &v,
+                                      float &t, uint32_t &hitIndex) const override {
+        float tHit[4];
+        int mask = intersectCluster(m_clusters[index], ray, tHit);
+        if (!mask)
+            return false;
+
+        int lane = -1;
+        for (int i = 0; i < 4; ++i) {
+            if ((mask & (1 << i)) && (lane < 0 || tHit[i] < tHit[lane]))
+                lane = i;
+        }
+        t = tHit[lane];
+        u = v = 0.f;
+        hitIndex = 4 * index + (uint32_t) lane;
+        return true;
+    }
+
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const override {
+        float tHit[4];
+        return intersectCluster(m_clusters[index], ray, tHit) != 0;
+    }
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection &its) const override {
+        /* Same parameterization as the 'sphere' shape, so that both render identically */
+        its.p = ray(its.t);
+        Vector3f dir = (its.p - m_centers[index]).normalized();
+        its.geoFrame = Frame(dir);
+        its.uv = Point2f(
+            std::atan2(dir.y(), dir.x()) * INV_TWOPI + 0.5,
+            std::asin(dir.z()) * INV_PI + 0.5
+        );
+
+        its.dpdu = Vector3f(-dir.y(), dir.x(), 0.0f) * M_PI * 2;
+        float rd = its.dpdu.norm();
+        float invRd = 1 / rd;
+        float cos_phi = dir.x() * invRd;
+        float sin_phi = dir.y() * invRd;
+        its.dpdv = Vector3f(dir.z() * cos_phi, dir.z() * sin_phi, -rd) * M_PI;
+        Vector3f s = (its.dpdu + dir * dir.dot(its.dpdu)).normalized();
+        its.shFrame = Frame(s, dir.cross(s), dir);
+
+        its.mesh = m_owners[index];
+    }
+
+    virtual void sampleSurface(ShapeQueryRecord &sRec, const Point2f &sample) const override {
+        Point2f s = sample;
+        size_t index = m_pdf.sampleReuse(s.x());
+
+        Vector3f q = Warp::squareToUniformSphere(s);
+        sRec.p = m_centers[index] + m_radii[index] * q;
+        sRec.n = q;
+        sRec.pdf = m_pdf.getNormalization();
+    }
+
+    virtual float pdfSurface(const ShapeQueryRecord &sRec) const override {
+        return m_pdf.getNormalization();
+    }
+
+    virtual LightCone getLightCone() const override {
+        LightCone res;
+        res.axis = Vector3f(0.f);
+        res.theta_e = M_PI / 2;
+        res.theta_o = M_PI;
+        return res;
+    }
+
+    virtual LightCone getLightCone(uint32_t index) const override {
+        return getLightCone();
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "SphereSet[\n"
+            "  spheres = %i,\n"
+            "  nested = %i,\n"
+            "  clusters = %i,\n"
+            "  bsdf = %s,\n"
+            "  emitter = %s\n"
+            "  interior_medium = %s,\n"
+            "  exterior_medium = %s,\n"
+            "]",
+            m_centers.size(),
+            m_children.size(),
+            m_clusters.size(),
+            m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
+            m_emitter ? indent(m_emitter->toString()) : std::string("null"),
+            m_interior ? indent(m_interior->toString()) : std::string("null"),
+            m_exterior ? indent(m_exterior->toString()) : std::string("null")
+        );
+    }
+
+protected:
+    /// Four spheres, padded with NaN centers (which never report a hit)
+    struct alignas(16) Cluster {
+        float cx[4], cy[4], cz[4];
+        float r2[4];
+    };
+
+    /// Append a sphere; \c owner is reported as \c its.mesh (\c nullptr: the set itself)
+    void addSphere(const Point3f &center, float radius, const Shape *owner) {
+        if (!(radius > 0))
+            throw NoriException("SphereSet: invalid radius %f!", radius);
+        m_centers.push_back(center);
+        m_radii.push_back(radius);
+        m_owners.push_back(owner);
+        m_bbox.expandBy(center - Vector3f(radius));
+        m_bbox.expandBy(center + Vector3f(radius));
+    }
+
+    void loadSpheres(const filesystem::path &filename) {
+        std::ifstream is(filename.str());
+        if (is.fail())
+            throw NoriException("Unable to open sphere file \"%s\"!", filename);
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        std::string line;
+        size_t lineNumber = 0, count = 0;
+        while (std::getline(is, line)) {
+            ++lineNumber;
+            line = line.substr(0, line.find('#'));
+            std::istringstream iss(line);
+            float x, y, z, radius;
+            if (!(iss >> x))
+                continue;
+            if (!(iss >> y >> z >> radius))
+                throw NoriException("SphereSet: \"%s\", line %i: expected \"x y z radius\"!",
+                                    filename, lineNumber);
+            addSphere(Point3f(x, y, z), radius, nullptr);
+            ++count;
+        }
+
+        cout << "done. (N=" << count << ", took " << timer.elapsedString() << ")" << endl;
+    }
+
+    /**
+     * \brief Order the spheres so that every run of four is spatially compact
+     *
+     * Recursively splits the range at the median along the longest axis of
+     * its centers, rounding the split to a multiple of four so that clusters
+     * never straddle two halves.
+     */
+    void sortSpheres(uint32_t *begin, uint32_t *end) const {
+        while (end - begin > 4) {
+            BoundingBox3f centroids;
+            for (uint32_t *i = begin; i != end; ++i)
+                centroids.expandBy(m_centers[*i]);
+            int axis = centroids.getMajorAxis();
+
+            uint32_t *mid = begin + ((end - begin + 4) / 8) * 4;
+            std::nth_element(begin, mid, end, [&](uint32_t i, uint32_t j) {
+                return m_centers[i][axis] < m_centers[j][axis];
+            });
+            sortSpheres(begin, mid);
+            begin = mid;
+        }
+    }
+
+    /// Sort the spheres spatially and pack them into clusters of four
+    void buildClusters() {
+        size_t size = m_centers.size();
+        std::vector<uint32_t> order(size);
+        for (size_t i = 0; i < size; ++i)
+            order[i] = (uint32_t) i;
+        sortSpheres(order.data(), order.data() + size);
+
+        std::vector<Point3f> centers(size);
+        std::vector<float> radii(size);
+        std::vector<const Shape *> owners(size);
+        for (size_t i = 0; i < size; ++i) {
+            uint32_t j = order[i];
+            centers[i] = m_centers[j];
+            radii[i] = m_radii[j];
+            owners[i] = m_owners[j] ? m_owners[j] : this;
+        }
+        m_centers.swap(centers);
+        m_radii.swap(radii);
+        m_owners.swap(owners);
+
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        m_clusters.resize((size + 3) / 4);
+        m_clusterBounds.resize(m_clusters.size());
+        for (size_t c = 0; c < m_clusters.size(); ++c) {
+            Cluster &cluster = m_clusters[c];
+            BoundingBox3f &bounds = m_clusterBounds[c];
+            bounds.reset();
+            for (size_t k = 0; k < 4; ++k) {
+                size_t i = 4 * c + k;
+                if (i < size) {
+                    cluster.cx[k] = m_centers[i].x();
+                    cluster.cy[k] = m_centers[i].y();
+                    cluster.cz[k] = m_centers[i].z();
+                    cluster.r2[k] = m_radii[i] * m_radii[i];
+                    bounds.expandBy(m_centers[i] - Vector3f(m_radii[i]));
+                    bounds.expandBy(m_centers[i] + Vector3f(m_radii[i]));
+                } else {
+                    cluster.cx[k] = cluster.cy[k] = cluster.cz[k] = nan;
+                    cluster.r2[k] = 0.f;
+                }
+            }
+        }
+    }
+
+    /**
+     * \brief Intersect a ray with the four spheres of a cluster
+     *
+     * Uses the numerically robust formulation of the quadratic from
+     * "Precision Improvements for Ray/Sphere Intersection" (Haines et al.,
+     * Ray Tracing Gems): the discriminant is computed from the distance
+     * between the center and the ray, and the two roots as c/q and q/a.
+     *
+     * \return A bit mask of the lanes that were hit. \c t receives
+     *    the nearest valid distance of each of them.
+     */
+    static int intersectCluster(const Cluster &cluster, const Ray3f &ray, float *t) {
+#if defined(NORI_SPHERESET_SSE)
+        const __m128 dx = _mm_set1_ps(ray.d.x()), dy = _mm_set1_ps(ray.d.y()), dz = _mm_set1_ps(ray.d.z());
+        const __m128 a = _mm_set1_ps(ray.d.squaredNorm());
+        const __m128 invA = _mm_set1_ps(1.f / ray.d.squaredNorm());
+        const __m128 signMask = _mm_set1_ps(-0.f);
+
+        /* f = o - c */
+        __m128 fx = _mm_sub_ps(_mm_set1_ps(ray.o.x()), _mm_load_ps(cluster.cx));
+        __m128 fy = _mm_sub_ps(_mm_set1_ps(ray.o.y()), _mm_load_ps(cluster.cy));
+        __m128 fz = _mm_sub_ps(_mm_set1_ps(ray.o.z()), _mm_load_ps(cluster.cz));
+        __m128 r2 = _mm_load_ps(cluster.r2);
+
+        /* b' = -f.d, l = f + (b'/a) d, discriminant = a (r^2 - |l|^2) */
+        __m128 b = _mm_xor_ps(signMask,
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, dx), _mm_mul_ps(fy, dy)), _mm_mul_ps(fz, dz)));
+        __m128 s = _mm_mul_ps(b, invA);
+        __m128 lx = _mm_add_ps(fx, _mm_mul_ps(s, dx));
+        __m128 ly = _mm_add_ps(fy, _mm_mul_ps(s, dy));
+        __m128 lz = _mm_add_ps(fz, _mm_mul_ps(s, dz));
+        __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+        __m128 disc = _mm_mul_ps(a, _mm_sub_ps(r2, l2));
+        __m128 valid = _mm_cmpge_ps(disc, _mm_setzero_ps());
+
+        /* q = b' + sign(b') sqrt(discriminant), roots c/q and q/a */
+        __m128 c = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz)), r2);
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+        __m128 q = _mm_add_ps(b, _mm_or_ps(root, _mm_and_ps(b, signMask)));
+        __m128 t0 = _mm_div_ps(c, q);
+        __m128 t1 = _mm_mul_ps(q, invA);
+        __m128 tNear = _mm_min_ps(t0, t1), tFar = _mm_max_ps(t0, t1);
+
+        const __m128 mint = _mm_set1_ps(ray.mint), maxt = _mm_set1_ps(ray.maxt);
+        __m128 nearOk = _mm_and_ps(_mm_cmpge_ps(tNear, mint), _mm_cmple_ps(tNear, maxt));
+        __m128 farOk = _mm_and_ps(_mm_cmpge_ps(tFar, mint), _mm_cmple_ps(tFar, maxt));
+        __m128 tHit = _mm_or_ps(_mm_and_ps(nearOk, tNear), _mm_andnot_ps(nearOk, tFar));
+        _mm_storeu_ps(t, tHit);
+        return _mm_movemask_ps(_mm_and_ps(valid, _mm_or_ps(nearOk, farOk)));
+#else
+        const float a = ray.d.squaredNorm(), invA = 1.f / a;
+        int mask = 0;
+        for (int k = 0; k < 4; ++k) {
+            Vector3f f = ray.o - Point3f(cluster.cx[k], cluster.cy[k], cluster.cz[k]);
+            float b = -f.dot(ray.d);
+            Vector3f l = f + (b * invA) * ray.d;
+            float disc = a * (cluster.r2[k] - l.squaredNorm());
+            if (!(disc >= 0))
+                continue;
+
+            float q = b + std::copysign(std::sqrt(disc), b);
+            float t0 = (f.squaredNorm() - cluster.r2[k]) / q, t1 = q * invA;
+            if (t0 > t1)
+                std::swap(t0, t1);
+            if (t0 >= ray.mint && t0 <= ray.maxt)
+                t[k] = t0;
+            else if (t1 >= ray.mint && t1 <= ray.maxt)
+                t[k] = t1;
+            else
+                continue;
+            mask |= 1 << k;
+        }
+        return mask;
+#endif
+    }
+
+    std::vector<Point3f> m_centers;         ///< Sphere centers (in cluster order after activate())
+    std::vector<float> m_radii;             ///< Sphere radii
+    std::vector<const Shape *> m_owners;    ///< Shape reported for hits on each sphere
+    std::vector<Sphere *> m_children;       ///< Nested spheres (owned by this set)
+    std::vector<Cluster> m_clusters;        ///< Clusters of four spheres, one BVH primitive each
+    std::vector<BoundingBox3f> m_clusterBounds;
+    DiscretePDF m_pdf;                      ///< Area-proportional sphere selection
+};
+
+NORI_REGISTER_CLASS(SphereSet, "sphereset");
+NORI_NAMESPACE_END
@@ -1,14 +1,19 @@
 #include <nori/subscene.h>
+#include <nori/registry.h>
+#include <nori/mesh.h>
 
 NORI_NAMESPACE_BEGIN
 
-SubScene::SubScene (const PropertyList &propList) {
+SubScene::SubScene (const PropertyList &propList) : m_props(propList) {
     m_id = propList.getInteger("id", -1);
-    m_bvh = new BVH();
 }
 
 SubScene::~SubScene(){
-    delete m_mesh;
+    /* The BVH deletes the mesh it was created with */
+    bool owned = m_bvh && m_bvh->getShape(0) == m_mesh;
+    m_bvh.reset();
+    if (!owned)
+        delete m_mesh;
 }
 
 void SubScene::addChild(NoriObject *obj) {
@@ -19,8 +24,7 @@ void SubScene::addChild(NoriObject *obj) {
             if (m_mesh) 
                 throw NoriException("There can be only one shape per subscene!");
             m_mesh = static_cast<Shape *>(obj);
-            m_bvh->addShape(m_mesh);
-            m_bvh->build();
+            acquireBVH();
             break;
         
         default:
@@ -29,6 +33,56 @@ void SubScene::addChild(NoriObject *obj) {
         }
     }
 
+void SubScene::configureBVH(BVH *bvh) const {
+    const PropertyList &props = m_props;
+    bvh->setWidth(props.getInteger("bvhWidth", 2));
+    bvh->setPrecomputeTriangles(props.getBoolean("bvhTriangles", false));
+    bvh->setTriangleWidth(props.getInteger("bvhTriangleWidth", 1));
+    bvh->setLeafSize(props.getInteger("bvhLeafSize", 0));
+    bvh->setBuilder(props.getString("bvhBuilder", "sah"));
+    bvh->setSplitBudget(props.getFloat("bvhSplitBudget", 0.5f));
+    bvh->setCacheDirectory(props.getString("bvhCache", ""));
+    bvh->setCompression(props.getInteger("bvhCompression", 0));
+    bvh->setTreeletSize(props.getInteger("bvhTreeletSize", 0));
+}
+
+void SubScene::acquireBVH() {
+    const PropertyList &props = m_props;
+
+    /* Subscenes over the same geometry with the same settings share
+       one BVH, which is built later on by GeometryRegistry::buildPending() */
+    std::string settings = tfm::format("%i %i %i %i %s %f %s %i %i",
+                                       props.getInteger("bvhWidth", 2),
+                                       props.getBoolean("bvhTriangles", false),
+                                       props.getInteger("bvhTriangleWidth", 1),
+                                       props.getInteger("bvhLeafSize", 0),
+                                       props.getString("bvhBuilder", "sah"),
+                                       props.getFloat("bvhSplitBudget", 0.5f),
+                                       props.getString("bvhCache", ""),
+                                       props.getInteger("bvhCompression", 0),
+                                       props.getInteger("bvhTreeletSize", 0));
+    m_bvh = GeometryRegistry::get().acquireBVH(m_mesh, settings, [this](BVH *bvh) {
+        configureBVH(bvh);
+    });
+}
+
+void SubScene::refit() {
+    /* Mesh::setVertexPositions() gives the mesh its own copy of geometry
+       that other meshes share, while the shared BVH keeps the old one.
+       Switch to a private BVH over the new geometry in that case */
+    const Mesh *mesh = dynamic_cast<const Mesh *>(m_mesh);
+    const Mesh *built = dynamic_cast<const Mesh *>(m_bvh->getShape(0));
+    if (mesh && built && built != mesh && built->getGeometry() != mesh->getGeometry()) {
+        std::shared_ptr<BVH> bvh = std::make_shared<BVH>();
+        configureBVH(bvh.get());
+        bvh->addShape(m_mesh);
+        bvh->build();
+        m_bvh = bvh;
+        return;
+    }
+    m_bvh->refit();
+}
+
 std::string SubScene::toString() const{
     return tfm::format(
         "SubScene[\n"
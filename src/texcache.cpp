@@ -0,0 +1,205 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/texcache.h>
+#include <chrono>
+
+NORI_NAMESPACE_BEGIN
+
+TextureCache &TextureCache::get() {
+    static TextureCache cache;
+    return cache;
+}
+
+void TextureCache::setBudget(size_t budget) {
+    m_budget = budget;
+    for (Shard &s : m_shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        evict(s);
+    }
+}
+
+uint32_t TextureCache::addSource(std::unique_ptr<MemoryMappedFile> file, size_t offset,
+                                 size_t tileBytes) {
+    std::shared_ptr<Source> source = std::make_shared<Source>();
+    source->file = std::move(file);
+    source->offset = offset;
+    source->tileBytes = tileBytes;
+
+    std::lock_guard<std::mutex> lock(m_sourceMutex);
+    uint32_t id = m_nextSource++;
+    m_sources[id] = source;
+    return id;
+}
+
+void TextureCache::removeSource(uint32_t source) {
+    {
+        std::lock_guard<std::mutex> lock(m_sourceMutex);
+        auto it = m_sources.find(source);
+        if (it == m_sources.end())
+            return;
+        /* Retires the entries of this source among the recent tiles of every thread */
+        it->second->generation++;
+        m_sources.erase(it);
+    }
+
+    for (Shard &s : m_shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (auto it = s.entries.begin(); it != s.entries.end(); ) {
+            if ((uint32_t) (it->key >> 32) == source) {
+                s.memory -= it->tile->size();
+                s.index.erase(it->key);
+                it = s.entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+const TextureCache::Tile *TextureCache::getTile(uint32_t source, uint32_t index) {
+    uint64_t key = makeKey(source, index);
+
+    /* The recent tiles of this thread need neither a lock nor a change
+       of the shared reference counts */
+    static thread_local LocalTiles local;
+    for (auto &entry : local.entries) {
+        if (entry.key == key && entry.source->generation.load(std::memory_order_relaxed) == entry.generation) {
+            if (++local.hits == LOCAL_HIT_BATCH) {
+                m_localHits += local.hits;
+                local.hits = 0;
+            }
+            return entry.tile.get();
+        }
+    }
+
+    auto &entry = local.entries[local.next];
+    local.next = (local.next + 1) % LOCAL_TILE_COUNT;
+    entry.tile = findTile(source, index, entry.source);
+    entry.generation = entry.source->generation.load(std::memory_order_relaxed);
+    entry.key = key;
+    return entry.tile.get();
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::findTile(uint32_t source, uint32_t index,
+        std::shared_ptr<const Source> &src) {
+    uint64_t key = makeKey(source, index);
+    Shard &s = shard(key);
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it != s.index.end()) {
+            s.hits++;
+            s.entries.splice(s.entries.begin(), s.entries, it->second);
+            src = it->second->source;
+            return it->second->tile;
+        }
+        s.misses++;
+    }
+
+    /* Load the tile without holding the shard's lock, so that other
+       threads can keep using its resident tiles meanwhile */
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(m_sourceMutex);
+        auto it = m_sources.find(source);
+        if (it == m_sources.end())
+            throw NoriException("TextureCache: unknown tile source %u", source);
+        src = it->second;
+    }
+    size_t offset = src->offset + (size_t) index * src->tileBytes;
+    if (offset + src->tileBytes > src->file->size())
+        throw NoriException("TextureCache: tile %u is out of bounds in \"%s\"", index,
+                            src->file->getFilename());
+    const uint8_t *data = src->file->data() + offset;
+    std::shared_ptr<Tile> tile = std::make_shared<Tile>(data, data + src->tileBytes);
+    m_stallTime += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.index.find(key);
+    if (it != s.index.end()) {
+        /* Another thread loaded the same tile in the meantime */
+        s.entries.splice(s.entries.begin(), s.entries, it->second);
+        return it->second->tile;
+    }
+    s.entries.push_front(Entry { key, tile, src });
+    s.index[key] = s.entries.begin();
+    s.memory += tile->size();
+    evict(s);
+    return tile;
+}
+
+void TextureCache::evict(Shard &s) {
+    size_t budget = m_budget / SHARD_COUNT;
+    /* Always keep the most recently used tile */
+    while (s.memory > budget && s.entries.size() > 1) {
+        Entry &entry = s.entries.back();
+        s.memory -= entry.tile->size();
+        s.index.erase(entry.key);
+        s.entries.pop_back();
+        s.evictions++;
+    }
+}
+
+size_t TextureCache::getMemoryUsage() {
+    size_t memory = 0;
+    for (Shard &s : m_shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        memory += s.memory;
+    }
+    return memory;
+}
+
+void TextureCache::resetStatistics() {
+    for (Shard &s : m_shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.hits = s.misses = s.evictions = 0;
+    }
+    m_stallTime = 0;
+    m_localHits = 0;
+}
+
+TextureCache::Statistics TextureCache::getStatistics() {
+    Statistics result;
+    for (Shard &s : m_shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        result.hits += s.hits;
+        result.misses += s.misses;
+        result.evictions += s.evictions;
+    }
+    result.localHits = m_localHits;
+    result.hits += result.localHits;
+    result.stallTime = m_stallTime * 1e-6;
+    return result;
+}
+
+std::string TextureCache::statisticsString() {
+    Statistics stats = getStatistics();
+    uint64_t lookups = stats.hits + stats.misses;
+    if (lookups == 0)
+        return "";
+    return tfm::format(
+        "Texture cache: %llu tile lookups, %.2f%% hits (%.2f%% on recent tiles of the thread), "
+        "%llu loads, %llu evictions, %s stalled (summed over threads), %s of %s resident",
+        (unsigned long long) lookups, 100.0 * stats.hits / lookups,
+        100.0 * stats.localHits / lookups, (unsigned long long) stats.misses, (unsigned long long) stats.evictions,
+        timeString(stats.stallTime), memString(getMemoryUsage()), memString(m_budget));
+}
+
+NORI_NAMESPACE_END
@@ -86,7 +86,7 @@ public:
                     EmitterQueryRecord lightQuery = EmitterQueryRecord(its.p);
                     const Color3f radiance = light->sample(lightQuery, sampler->next2D());
 
-                    if (lightQuery.pdf > 0 && !scene->rayIntersect(lightQuery.shadowRay)) {
+                    if (lightQuery.pdf > 0 && !scene->occluded(lightQuery.shadowRay)) {
                         Vector3f wo = its.shFrame.toLocal(lightQuery.wi);
                         BSDFQueryRecord bsdfEvalQuery = BSDFQueryRecord(
                             wi,